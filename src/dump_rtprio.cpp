@@ -5,58 +5,117 @@
 //
 // The output format is the following comma-separated columns:
 // exe,name,cpumask,policy,nice,priority,tid,pid,ppid,sid,cpu
+//
+// --format binary writes the same data in the fixed-width layout described in
+// snapshot_format.h instead, for capturing at high rates. --format tree prints
+// each process with its exe and command line followed by its threads.
+// --summary prints counts of tasks by policy, priority, and the CPUs in their
+// cpumask, followed by the --top N highest-priority tasks, instead of a row
+// for each task.
+//
+// Tasks are found by walking /proc and each /proc/<pid>/task directory. Pass
+// --scan-pid-max to instead probe every PID up to
+// /proc/sys/kernel/pid_max, which is much slower but doesn't depend on being
+// able to list /proc. --sched-attr appends
+// sched_flags,runtime_ns,deadline_ns,period_ns,util_min,util_max columns from
+// sched_getattr(), which is also how --syscalls gets the policy, priority, and
+// nice value in one syscall when the kernel has it. --cgroup appends
+// cgroup,cpuset,isolated_cpus columns: the process's cgroup in the hierarchy
+// with the cpuset controller, the CPUs that cgroup allows, and the CPUs in the
+// task's cpumask that are isolated with isolcpus= or nohz_full=. --irq appends
+// irq,irq_cpus columns: the IRQ an IRQ thread handles and the CPUs
+// /proc/irq/<irq>/smp_affinity_list routes it to. --schedstat appends
+// run_ns,wait_ns,timeslices columns from /proc/<pid>/schedstat: how long the
+// task has run and waited on a run queue, and how many times it was switched
+// to. --columns picks which of these columns are written and in what order,
+// and only the parts of /proc and the syscalls those columns need are read.
+//
+// With --watch INTERVAL, the table is kept in memory and rescanned every
+// INTERVAL seconds, and only the rows of tasks that appeared, exited, or had
+// their scheduling state change are printed, with a leading event column of
+// "new", "exited", or "changed". --rates adds
+// utime_ms,stime_ms,voluntary_ctxt_switches,nonvoluntary_ctxt_switches columns
+// with what each task used since the previous scan, and an "active" event for
+// tasks that used any CPU time or context switched but didn't otherwise change.
+// When the schedstat columns are collected, --rates also adds
+// run_us,wait_us,max_wait_us,slices columns: the run and wait time and
+// timeslices since the previous scan, and the longest wait_us the task has had
+// since it was first seen, which is what shows a high-priority thread not
+// getting the CPU when it should.
+//
+// With --daemon NAME, nothing is printed. Instead a snapshot in the binary
+// layout is published in the POSIX shared memory object NAME every --interval
+// seconds, for other processes to read as described in snapshot_format.h.
+// With --stream udp://HOST:PORT or tcp://HOST:PORT, where HOST is an IPv4 or
+// bracketed IPv6 address, the same tasks are sent to a collector on another
+// machine every --interval seconds instead, as frames of only what changed
+// since the previous one.
+//
+// --events makes any of these modes subscribe to the kernel's proc connector
+// and recollect tasks as soon as they fork, exec(), exit, or are renamed,
+// which also catches short-lived threads. The kernel doesn't report scheduling
+// changes, so everything is still rescanned every interval.
+//
+// --apply RULES sets the scheduling of the tasks instead, by the first line of
+// RULES whose regex matches each one's name:
+//
+//   # name regex    policy  priority  cpulist
+//   ^irq/.*-can     FIFO    50        1
+//   ^FRC_NetComm    FIFO    40        -
+//   ^robot          -       -         2-3
+//
+// A "before" and "after" row is printed for each task that changed, and the
+// exit status is 1 if any change failed.
+//
+// Scanning takes CPU time from the tasks being inspected, so --self-sched
+// "POLICY PRIORITY CPUS" sets this process's own scheduling with the same
+// fields first, like "IDLE - 0" to only run on CPU 0 when it's otherwise idle.
+// --scan-stats prints what each scan cost, and --yield N gives up the CPU
+// after every N tasks in watch, daemon, and stream mode.
+//
+// The collection itself is in task_snapshot.h, so other programs can take the
+// same snapshots in-process with TaskSnapshot instead of running this.
 
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <linux/cn_proc.h>
+#include <linux/connector.h>
+#include <linux/netlink.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <regex.h>
 #include <sched.h>
 #include <stdint.h>
+#include <sys/mman.h>
 #include <sys/resource.h>
+#include <sys/socket.h>
 #include <sys/time.h>
+#include <time.h>
 #include <unistd.h>
 
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cerrno>
+#include <charconv>
 #include <cstdio>
-#include <cstdlib>
-#include <iostream>
-#include <stdexcept>
+#include <cstring>
+#include <limits>
+#include <map>
+#include <memory>
 #include <string>
 #include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
 
-namespace {
-
-template <typename T>
-void CHECK_EQ(T val1, T val2) {
-  if (val1 != val2) {
-    throw std::runtime_error("CHECK_EQ() failed");
-  }
-}
-
-template <typename T>
-void PCHECK(T val) {
-  if (val != 0) {
-    throw std::runtime_error("PCHECK() failed");
-  }
-}
-
-enum LogLevel { FATAL, WARNING };
-
-template <typename T, typename... Ts>
-void LOG(LogLevel level, T val, Ts&&... vals) {
-  if (level == FATAL) {
-    std::cerr << "FATAL: ";
-  } else if (level == WARNING) {
-    std::cerr << "WARNING: ";
-  }
-
-  std::fprintf(stderr, val, vals...);
-  std::cerr << "\n";
-
-  if (level == FATAL) {
-    std::exit(1);
-  }
-}
+#include "logging.h"
+#include "snapshot_format.h"
+#include "task_snapshot.h"
 
-template <typename T, typename... Ts>
-void PLOG(LogLevel level, T val, Ts&&... vals) {
-  LOG(level, val, vals...);
-}
+namespace dump_rtprio {
+namespace {
 
 const char* policy_string(uint32_t policy) {
   switch (policy) {
@@ -79,270 +138,2948 @@ const char* policy_string(uint32_t policy) {
   }
 }
 
-std::string_view strip(std::string_view str) {
-  // Left strip
-  while (str.front() == ' ' || str.front() == '\t' || str.front() == '\n') {
-    str.remove_prefix(1);
+// Formats CpuMasks as either a CPU list like "0-3,6" or a hex bitmap like
+// "4f" (the formats taskset(1) accepts). The per-byte tables are built once so
+// formatting a mask is a lookup per byte instead of work per CPU.
+class CpuMaskFormatter {
+ public:
+  enum Format { kList, kHex };
+
+  explicit CpuMaskFormatter(Format format) : format_{format} {
+    constexpr char kDigits[] = "0123456789abcdef";
+    for (int byte = 0; byte < 256; ++byte) {
+      hex_[byte][0] = kDigits[byte >> 4];
+      hex_[byte][1] = kDigits[byte & 0xf];
+
+      ByteRuns& runs = runs_[byte];
+      for (int bit = 0; bit < 8; ++bit) {
+        if ((byte & (1 << bit)) == 0) {
+          continue;
+        }
+        if (runs.count > 0 && runs.last[runs.count - 1] == bit - 1) {
+          runs.last[runs.count - 1] = bit;
+        } else {
+          runs.first[runs.count] = bit;
+          runs.last[runs.count] = bit;
+          ++runs.count;
+        }
+      }
+    }
   }
 
-  // Right strip
-  while (str.back() == ' ' || str.back() == '\t' || str.back() == '\n') {
-    str.remove_suffix(1);
+  // Returns the text for mask. It's only valid until the next call.
+  std::string_view format(const CpuMask& mask) const {
+    if (mask.size() != mask_words_) {
+      resize(mask.size());
+    }
+    size_ = 0;
+    if (format_ == kList) {
+      format_list(mask);
+    } else {
+      format_hex(mask);
+    }
+    return {buffer_.data(), size_};
   }
 
-  return str;
-}
+ private:
+  // The runs of consecutive set bits in a byte. There can be at most 4.
+  struct ByteRuns {
+    uint8_t count = 0;
+    uint8_t first[4] = {};
+    uint8_t last[4] = {};
+  };
+
+  Format format_;
+  ByteRuns runs_[256];
+  char hex_[256][2];
+
+  // Sized by resize() for the longest text a mask that many words long can
+  // have.
+  mutable std::vector<char> buffer_;
+  mutable size_t mask_words_ = 0;
+  mutable size_t size_ = 0;
+
+  // Every mask is System::cpu_mask_words long, so this only happens once.
+  void resize(size_t mask_words) const {
+    const size_t cpus = mask_words * kBitsPerWord;
+    char digits[24];
+    const size_t max_digits =
+        std::to_chars(digits, digits + sizeof(digits), cpus).ptr - digits;
 
-int find_pid_max() {
-  std::FILE* pid_max_file = std::fopen("/proc/sys/kernel/pid_max", "r");
-  if (pid_max_file == nullptr) {
-    PLOG(FATAL, "fopen(\"/proc/sys/kernel/pid_max\")");
+    // Each CPU in a list takes at most its digits and a separator, which is
+    // more than the hex digit for every 4 CPUs.
+    buffer_.resize(cpus * (max_digits + 1) + 1);
+    mask_words_ = mask_words;
   }
 
-  int r;
-  CHECK_EQ(1, std::fscanf(pid_max_file, "%d", &r));
+  void append(char c) const { buffer_[size_++] = c; }
 
-  PCHECK(std::fclose(pid_max_file));
+  void append(int value) const {
+    char* const begin = buffer_.data();
+    size_ = std::to_chars(begin + size_, begin + buffer_.size(), value).ptr -
+            begin;
+  }
 
-  return r;
-}
+  void append_run(int first, int last) const {
+    if (size_ > 0) {
+      append(',');
+    }
+    append(first);
+    if (last != first) {
+      append('-');
+      append(last);
+    }
+  }
 
-cpu_set_t find_all_cpus() {
-  int16_t nproc = sysconf(_SC_NPROCESSORS_CONF);
-  if (nproc == -1) {
-    PLOG(FATAL, "sysconf(_SC_NPROCESSORS_CONF)");
+  void format_list(const CpuMask& mask) const {
+    // The run being built, which may continue into the next byte.
+    int first = -1;
+    int last = -2;
+
+    for (size_t word = 0; word < mask.size(); ++word) {
+      if (mask[word] == 0) {
+        continue;
+      }
+      for (int shift = 0; shift < kBitsPerWord; shift += 8) {
+        const ByteRuns& runs = runs_[(mask[word] >> shift) & 0xff];
+        const int base = word * kBitsPerWord + shift;
+        for (int i = 0; i < runs.count; ++i) {
+          if (base + runs.first[i] == last + 1) {
+            last = base + runs.last[i];
+          } else {
+            if (first != -1) {
+              append_run(first, last);
+            }
+            first = base + runs.first[i];
+            last = base + runs.last[i];
+          }
+        }
+      }
+    }
+    if (first != -1) {
+      append_run(first, last);
+    }
   }
 
-  cpu_set_t r;
-  CPU_ZERO(&r);
-  for (int16_t i = 0; i < nproc; ++i) {
-    CPU_SET(i, &r);
+  void format_hex(const CpuMask& mask) const {
+    for (size_t word = mask.size(); word-- > 0;) {
+      for (int shift = kBitsPerWord - 8; shift >= 0; shift -= 8) {
+        const int byte = (mask[word] >> shift) & 0xff;
+        if (size_ == 0) {
+          // Skip leading zeroes.
+          if (byte == 0) {
+            continue;
+          }
+          if (byte < 0x10) {
+            append(hex_[byte][1]);
+            continue;
+          }
+        }
+        append(hex_[byte][0]);
+        append(hex_[byte][1]);
+      }
+    }
+    if (size_ == 0) {
+      append('0');
+    }
   }
+};
 
-  return r;
-}
+// The CSV columns, in the default order.
+enum ColumnId {
+  kExeColumn,
+  kNameColumn,
+  kCpuMaskColumn,
+  kPolicyColumn,
+  kNiceColumn,
+  kPriorityColumn,
+  kTidColumn,
+  kPidColumn,
+  kPpidColumn,
+  kSidColumn,
+  kCpuColumn,
+  kSchedFlagsColumn,
+  kRuntimeColumn,
+  kDeadlineColumn,
+  kPeriodColumn,
+  kUtilMinColumn,
+  kUtilMaxColumn,
+  kCgroupColumn,
+  kCpusetColumn,
+  kIsolatedCpusColumn,
+  kIrqColumn,
+  kIrqCpusColumn,
+  kRunTimeColumn,
+  kWaitTimeColumn,
+  kTimeslicesColumn,
+  kNumColumns
+};
 
-cpu_set_t find_cpu_mask(int process, bool* not_there) {
-  cpu_set_t r;
-  const int result = sched_getaffinity(process, sizeof(r), &r);
+struct ColumnInfo {
+  const char* name;
 
-  if (result == -1 && errno == ESRCH) {
-    *not_there = true;
-    return cpu_set_t();
+  // The Sources collect_task() has to read for the column.
+  uint32_t sources;
+};
+
+// Indexed by ColumnId. tid and pid come from listing /proc.
+constexpr ColumnInfo kColumns[kNumColumns] = {
+    {"exe", kExeSource},
+    {"name", kStatSource},
+    {"cpumask", kAffinitySource},
+    {"policy", kSchedStateSource},
+    {"nice", kSchedStateSource},
+    {"priority", kSchedStateSource},
+    {"tid", 0},
+    {"pid", 0},
+    {"ppid", kStatSource},
+    {"sid", kStatSource},
+    {"cpu", kStatSource},
+    {"sched_flags", kSchedAttrSource},
+    {"runtime_ns", kSchedAttrSource},
+    {"deadline_ns", kSchedAttrSource},
+    {"period_ns", kSchedAttrSource},
+    {"util_min", kSchedAttrSource},
+    {"util_max", kSchedAttrSource},
+    {"cgroup", kCgroupSource},
+    {"cpuset", kCgroupSource},
+    {"isolated_cpus", kAffinitySource},
+    {"irq", kStatSource},
+    {"irq_cpus", kStatSource | kIrqSource},
+    {"run_ns", kSchedstatSource},
+    {"wait_ns", kSchedstatSource},
+    {"timeslices", kSchedstatSource},
+};
+
+// Returns the columns written when --columns isn't given.
+std::vector<ColumnId> default_columns(bool sched_attr, bool cgroup, bool irq,
+                                      bool schedstat) {
+  std::vector<ColumnId> r;
+  for (int id = kExeColumn; id <= kCpuColumn; ++id) {
+    r.push_back(static_cast<ColumnId>(id));
   }
-  if (result != 0) {
-    PLOG(FATAL, "sched_getaffinity(%d, %zu, %p)", process, sizeof(r), &r);
+  if (sched_attr) {
+    for (int id = kSchedFlagsColumn; id <= kUtilMaxColumn; ++id) {
+      r.push_back(static_cast<ColumnId>(id));
+    }
+  }
+  if (cgroup) {
+    for (int id = kCgroupColumn; id <= kIsolatedCpusColumn; ++id) {
+      r.push_back(static_cast<ColumnId>(id));
+    }
+  }
+  if (irq) {
+    r.push_back(kIrqColumn);
+    r.push_back(kIrqCpusColumn);
+  }
+  if (schedstat) {
+    for (int id = kRunTimeColumn; id <= kTimeslicesColumn; ++id) {
+      r.push_back(static_cast<ColumnId>(id));
+    }
   }
-
   return r;
 }
 
-sched_param find_sched_param(int process, bool* not_there) {
-  sched_param r;
-  const int result = sched_getparam(process, &r);
+// Command line options. The ones in CollectOptions decide what's collected.
+struct Options : CollectOptions {
+  // Add the rest of what sched_getattr() returns as CSV columns.
+  bool sched_attr = false;
+
+  // Add each task's cgroup, its cpuset, and which of the isolated CPUs the
+  // task may run on as CSV columns.
+  bool cgroup = false;
+
+  // Add the IRQ each IRQ thread handles and the CPUs that IRQ is routed to as
+  // CSV columns.
+  bool irq = false;
+
+  // Add the time each task ran and waited to run and its number of timeslices
+  // from /proc/<pid>/schedstat as CSV columns.
+  bool schedstat = false;
 
-  if (result == -1 && errno == ESRCH) {
-    *not_there = true;
-    return sched_param();
+  // What to write the tasks as.
+  enum Format { kCsv, kBinary, kTree };
+  Format format = kCsv;
+
+  // Print counts of tasks by policy, priority, and CPU, then the top
+  // highest-priority tasks of them, instead of a row for each task. top is -1
+  // if --top isn't given.
+  bool summary = false;
+  int top = -1;
+
+  // How to print the cpumask column.
+  CpuMaskFormatter::Format cpu_mask_format = CpuMaskFormatter::kList;
+
+  // Time this many scans instead of printing the result of one.
+  int bench = 0;
+
+  // Rescan this often and only print what changed.
+  bool watch = false;
+  timespec watch_interval = {};
+
+  // In watch mode, also report the CPU time and context switches each task
+  // used since the last scan.
+  bool rates = false;
+
+  // In watch, daemon, and stream mode, also recollect tasks as soon as the
+  // proc connector reports they were created or exited, and only rescan
+  // everything every interval to catch scheduling changes.
+  bool events = false;
+
+  // Apply the rules in this file to the tasks instead of just printing them,
+  // if it's not null.
+  const char* apply_path = nullptr;
+
+  // Set this process's scheduling to the policy, priority, and CPU list in
+  // this string before scanning, if it's not null.
+  const char* self_sched = nullptr;
+
+  // Print what each scan cost this process to stderr.
+  bool scan_stats = false;
+
+  // Publish a snapshot in the shared memory object with this name every
+  // publish_interval instead of printing anything, if it's not null.
+  const char* daemon_name = nullptr;
+  size_t daemon_capacity = 4 << 20;
+
+  // Send a frame to the collector at this URL every publish_interval instead
+  // of printing anything, if it's not null.
+  const char* stream_url = nullptr;
+
+  timespec publish_interval = {1, 0};
+
+  // The CSV columns to write. Filled in from the other options if --columns
+  // isn't given.
+  std::vector<ColumnId> columns;
+
+  // Sets sources to what the columns, filters, and mode need.
+  void find_sources() {
+    sources = 0;
+    for (ColumnId column : columns) {
+      sources |= kColumns[column].sources;
+    }
+
+    // The other formats and modes use the default columns' data.
+    if (format == kTree) {
+      sources |= kCmdlineSource;
+    }
+    if (rates && watch) {
+      sources |= kStatusSource | kStatSource;
+    }
+    if (apply_path != nullptr) {
+      sources |= kStatSource | kSchedStateSource | kAffinitySource;
+    }
+
+    // stat's starttime is how watch, daemon, and stream mode tell tasks that
+    // reused a TID apart.
+    if (watch || daemon_name != nullptr || stream_url != nullptr) {
+      sources |= kStatSource;
+    }
+
+    resolve_sources();
   }
-  if (result != 0) {
-    PLOG(FATAL, "sched_getparam(%d)", process);
+};
+
+// Accumulates output in a large buffer and writes it to a file descriptor in
+// as few write() calls as possible, rather than one per row.
+class OutputBuffer {
+ public:
+  explicit OutputBuffer(int fd) : fd_{fd} {}
+
+  OutputBuffer(const OutputBuffer&) = delete;
+  OutputBuffer& operator=(const OutputBuffer&) = delete;
+
+  ~OutputBuffer() { flush(); }
+
+  void append(std::string_view str) {
+    if (str.size() > sizeof(buffer_) - size_) {
+      flush();
+      if (str.size() > sizeof(buffer_)) {
+        write_all(str.data(), str.size());
+        return;
+      }
+    }
+    std::copy(str.begin(), str.end(), buffer_ + size_);
+    size_ += str.size();
   }
 
-  return r;
-}
+  void append(char c) {
+    if (size_ == sizeof(buffer_)) {
+      flush();
+    }
+    buffer_[size_++] = c;
+  }
 
-int find_scheduler(int process, bool* not_there) {
-  int scheduler = sched_getscheduler(process);
+  template <typename T>
+  void append_int(T value) {
+    // Enough for any 64-bit integer and its sign.
+    if (sizeof(buffer_) - size_ < 21) {
+      flush();
+    }
+    size_ = std::to_chars(buffer_ + size_, buffer_ + sizeof(buffer_), value)
+                .ptr -
+            buffer_;
+  }
 
-  if (scheduler == -1 && errno == ESRCH) {
-    *not_there = true;
-    return 0;
+  // Writes out everything appended so far.
+  void flush() {
+    write_all(buffer_, size_);
+    size_ = 0;
   }
-  if (scheduler == -1) {
-    PLOG(FATAL, "sched_getscheduler(%d)", process);
+
+ private:
+  int fd_;
+  char buffer_[65536];
+  size_t size_ = 0;
+
+  void write_all(const char* data, size_t size) {
+    while (size > 0) {
+      const ssize_t written = write(fd_, data, size);
+      count_syscalls(1);
+      if (written == -1) {
+        if (errno == EINTR) {
+          continue;
+        }
+        PLOG(FATAL, "write(%d, %p, %zu)", fd_, data, size);
+      }
+      data += written;
+      size -= written;
+    }
   }
+};
 
-  return scheduler;
-}
+// What a task used between two watch mode scans.
+struct TaskDelta {
+  uint64_t utime_ms = 0;
+  uint64_t stime_ms = 0;
+  uint64_t voluntary_ctxt_switches = 0;
+  uint64_t nonvoluntary_ctxt_switches = 0;
+
+  // From schedstat, if it's collected. max_wait_us is the most wait_us has
+  // been between any two scans since the task was first seen.
+  uint64_t run_us = 0;
+  uint64_t wait_us = 0;
+  uint64_t max_wait_us = 0;
+  uint64_t slices = 0;
+};
+
+// Where a snapshot of the collected tasks goes. Each snapshot is begin(), then
+// write_task() for each task in TID order, then end().
+class OutputBackend {
+ public:
+  virtual ~OutputBackend() = default;
+
+  virtual void begin() = 0;
+  virtual void write_task(const TaskRecord& task) = 0;
+  virtual void end() = 0;
+};
+
+// Writes tasks as CSV rows.
+class CsvWriter : public OutputBackend {
+ public:
+  // Writes options.columns. The default layouts are written by code
+  // specialized for them, and anything else goes through a table of
+  // per-column functions.
+  CsvWriter(int fd, const Options& options, const System& system)
+      : out_{fd},
+        formatter_{options.cpu_mask_format},
+        columns_{options.columns},
+        schedstat_deltas_{options.needs_schedstat()},
+        isolated_cpus_{system.isolated_cpus} {
+    write_columns_ = &CsvWriter::write_selected_columns;
+    for (size_t layout = 0; layout < kNumDefaultLayouts; ++layout) {
+      if (columns_ == default_columns(layout & kSchedAttrLayout,
+                                      layout & kCgroupLayout,
+                                      layout & kIrqLayout,
+                                      layout & kSchedstatLayout)) {
+        write_columns_ = default_writer(layout);
+      }
+    }
+  }
 
-std::string find_exe(int process, bool* not_there) {
-  std::string exe_filename = "/proc/" + std::to_string(process) + "/exe";
-  char exe_buffer[1024];
-  ssize_t exe_size =
-      readlink(exe_filename.c_str(), exe_buffer, sizeof(exe_buffer));
+  void begin() override { write_header(false); }
 
-  if (exe_size == -1) {
-    if (errno == ENOENT) {
-      return "ENOENT";
+  void end() override { flush(); }
+
+  // Writes the header row, with a leading event column if the rows will be
+  // written with write_event() and trailing TaskDelta columns if they'll
+  // include one.
+  void write_header(bool events, bool deltas = false) {
+    if (events) {
+      out_.append("event,");
+    }
+    for (size_t i = 0; i < columns_.size(); ++i) {
+      if (i > 0) {
+        out_.append(',');
+      }
+      out_.append(kColumns[columns_[i]].name);
     }
-    if (errno == ESRCH) {
-      *not_there = true;
-      return "";
+    if (deltas) {
+      out_.append(",utime_ms,stime_ms,voluntary_ctxt_switches,"
+                  "nonvoluntary_ctxt_switches");
+      if (schedstat_deltas_) {
+        out_.append(",run_us,wait_us,max_wait_us,slices");
+      }
     }
-    PLOG(FATAL, "readlink(%s, %p, %zu)", exe_filename.c_str(), exe_buffer,
-         sizeof(exe_buffer));
+    out_.append('\n');
   }
 
-  return std::string(exe_buffer, exe_size);
-}
+  void write_task(const TaskRecord& task) override {
+    (this->*write_columns_)(task);
+    out_.append('\n');
+  }
+
+  void write_event(std::string_view event, const TaskRecord& task,
+                   const TaskDelta* delta = nullptr) {
+    out_.append(event);
+    out_.append(',');
+    (this->*write_columns_)(task);
+    if (delta != nullptr) {
+      for (uint64_t value :
+           {delta->utime_ms, delta->stime_ms, delta->voluntary_ctxt_switches,
+            delta->nonvoluntary_ctxt_switches}) {
+        out_.append(',');
+        out_.append_int(value);
+      }
+      if (schedstat_deltas_) {
+        for (uint64_t value : {delta->run_us, delta->wait_us,
+                               delta->max_wait_us, delta->slices}) {
+          out_.append(',');
+          out_.append_int(value);
+        }
+      }
+    }
+    out_.append('\n');
+  }
 
-int find_nice_value(int process, bool* not_there) {
-  errno = 0;
-  int nice_value = getpriority(PRIO_PROCESS, process);
+  void flush() { out_.flush(); }
 
-  if (errno == ESRCH) {
-    *not_there = true;
-    return 0;
+ private:
+  using ColumnWriter = void (CsvWriter::*)(const TaskRecord&);
+
+  OutputBuffer out_;
+  CpuMaskFormatter formatter_;
+  std::vector<ColumnId> columns_;
+  ColumnWriter write_columns_;
+
+  // Whether TaskDelta's schedstat fields are written after the others.
+  bool schedstat_deltas_;
+
+  const CpuMask& isolated_cpus_;
+
+  // Holds the isolated CPUs in each task's cpumask while it's written.
+  CpuMask isolated_;
+
+  template <ColumnId kId>
+  void write_column(const TaskRecord& task) {
+    if constexpr (kId == kExeColumn) {
+      out_.append(task.exe);
+    } else if constexpr (kId == kNameColumn) {
+      out_.append(task.name);
+    } else if constexpr (kId == kCpuMaskColumn) {
+      out_.append(formatter_.format(task.cpu_mask));
+    } else if constexpr (kId == kPolicyColumn) {
+      out_.append(policy_string(task.policy));
+    } else if constexpr (kId == kNiceColumn) {
+      out_.append_int(task.nice);
+    } else if constexpr (kId == kPriorityColumn) {
+      out_.append_int(task.priority);
+    } else if constexpr (kId == kTidColumn) {
+      out_.append_int(task.tid);
+    } else if constexpr (kId == kPidColumn) {
+      out_.append_int(task.pid);
+    } else if constexpr (kId == kPpidColumn) {
+      out_.append_int(task.ppid);
+    } else if constexpr (kId == kSidColumn) {
+      out_.append_int(task.sid);
+    } else if constexpr (kId == kCpuColumn) {
+      out_.append_int(task.cpu);
+    } else if constexpr (kId == kSchedFlagsColumn) {
+      out_.append_int(task.sched_flags);
+    } else if constexpr (kId == kRuntimeColumn) {
+      out_.append_int(task.runtime);
+    } else if constexpr (kId == kDeadlineColumn) {
+      out_.append_int(task.deadline);
+    } else if constexpr (kId == kPeriodColumn) {
+      out_.append_int(task.period);
+    } else if constexpr (kId == kUtilMinColumn) {
+      out_.append_int(task.util_min);
+    } else if constexpr (kId == kUtilMaxColumn) {
+      out_.append_int(task.util_max);
+    } else if constexpr (kId == kCgroupColumn) {
+      out_.append(task.cgroup);
+    } else if constexpr (kId == kCpusetColumn) {
+      out_.append(task.cpuset);
+    } else if constexpr (kId == kIsolatedCpusColumn) {
+      isolated_.resize(task.cpu_mask.size());
+      for (size_t i = 0; i < isolated_.size(); ++i) {
+        isolated_[i] = task.cpu_mask[i] & isolated_cpus_[i];
+      }
+      out_.append(formatter_.format(isolated_));
+    } else if constexpr (kId == kIrqColumn) {
+      // Left empty for tasks that aren't IRQ threads.
+      if (task.irq != -1) {
+        out_.append_int(task.irq);
+      }
+    } else if constexpr (kId == kIrqCpusColumn) {
+      out_.append(task.irq_cpus);
+    } else if constexpr (kId == kRunTimeColumn) {
+      out_.append_int(task.run_time);
+    } else if constexpr (kId == kWaitTimeColumn) {
+      out_.append_int(task.wait_time);
+    } else {
+      static_assert(kId == kTimeslicesColumn);
+      out_.append_int(task.timeslices);
+    }
   }
-  if (errno != 0) {
-    PLOG(FATAL, "getpriority(PRIO_PROCESS, %d)", process);
+
+  // Writes the columns kFirst through kLast, which the compiler can inline
+  // into straight-line code.
+  template <ColumnId kFirst, ColumnId kLast>
+  void write_column_range(const TaskRecord& task) {
+    write_column<kFirst>(task);
+    if constexpr (kFirst != kLast) {
+      out_.append(',');
+      write_column_range<static_cast<ColumnId>(kFirst + 1), kLast>(task);
+    }
   }
 
-  return nice_value;
-}
+  // The groups of optional columns in a default layout, as bits of its
+  // index.
+  static constexpr size_t kSchedAttrLayout = 1 << 0;
+  static constexpr size_t kCgroupLayout = 1 << 1;
+  static constexpr size_t kIrqLayout = 1 << 2;
+  static constexpr size_t kSchedstatLayout = 1 << 3;
+  static constexpr size_t kNumDefaultLayouts = 1 << 4;
+
+  // Writes the columns default_columns() returns for the groups in kLayout.
+  template <size_t kLayout>
+  void write_default_columns(const TaskRecord& task) {
+    constexpr bool kSchedAttr = kLayout & kSchedAttrLayout;
+    constexpr bool kCgroup = kLayout & kCgroupLayout;
+    constexpr bool kIrq = kLayout & kIrqLayout;
+    constexpr bool kSchedstat = kLayout & kSchedstatLayout;
+    write_column_range<kExeColumn, kCpuColumn>(task);
+    if constexpr (kSchedAttr) {
+      out_.append(',');
+      write_column_range<kSchedFlagsColumn, kUtilMaxColumn>(task);
+    }
+    if constexpr (kCgroup) {
+      out_.append(',');
+      write_column_range<kCgroupColumn, kIsolatedCpusColumn>(task);
+    }
+    if constexpr (kIrq) {
+      out_.append(',');
+      write_column_range<kIrqColumn, kIrqCpusColumn>(task);
+    }
+    if constexpr (kSchedstat) {
+      out_.append(',');
+      write_column_range<kRunTimeColumn, kTimeslicesColumn>(task);
+    }
+  }
 
-void read_stat(int process, int* ppid, int* sid, bool* not_there) {
-  std::string stat_filename = "/proc/" + std::to_string(process) + "/stat";
-  std::FILE* stat = std::fopen(stat_filename.c_str(), "r");
+  template <size_t... kLayouts>
+  static constexpr std::array<ColumnWriter, kNumDefaultLayouts>
+  make_default_writers(std::index_sequence<kLayouts...>) {
+    return {&CsvWriter::write_default_columns<kLayouts>...};
+  }
 
-  if (stat == nullptr && errno == ENOENT) {
-    *not_there = true;
-    return;
+  static ColumnWriter default_writer(size_t layout) {
+    // Indexed by layout.
+    static constexpr std::array<ColumnWriter, kNumDefaultLayouts>
+        kDefaultWriters = make_default_writers(
+            std::make_index_sequence<kNumDefaultLayouts>());
+    return kDefaultWriters[layout];
   }
-  if (stat == nullptr) {
-    PLOG(FATAL, "fopen(%s, \"r\")", stat_filename.c_str());
+
+  template <size_t... kIds>
+  static constexpr std::array<ColumnWriter, kNumColumns> make_column_writers(
+      std::index_sequence<kIds...>) {
+    return {&CsvWriter::write_column<static_cast<ColumnId>(kIds)>...};
   }
 
-  char buffer[2048];
-  if (std::fgets(buffer, sizeof(buffer), stat) == nullptr) {
-    if (std::ferror(stat)) {
-      if (errno == ESRCH) {
-        *not_there = true;
-        return;
+  void write_selected_columns(const TaskRecord& task) {
+    // Indexed by ColumnId.
+    static constexpr std::array<ColumnWriter, kNumColumns> kColumnWriters =
+        make_column_writers(std::make_index_sequence<kNumColumns>());
+
+    for (size_t i = 0; i < columns_.size(); ++i) {
+      if (i > 0) {
+        out_.append(',');
       }
-      PLOG(FATAL, "fgets(%p, %zu, %p)", buffer, sizeof(buffer), stat);
+      (this->*kColumnWriters[columns_[i]])(task);
     }
   }
+};
 
-  int pid = 0;
+// Builds snapshots in the layout described in snapshot_format.h. The whole
+// snapshot is built in memory since the header needs the final counts.
+class SnapshotBuilder {
+ public:
+  explicit SnapshotBuilder(const System& system) : system_{system} {}
 
-  int field = 0;
-  size_t field_start = 0;
-  int parens = 0;
-  for (size_t i = 0; i < sizeof(buffer); ++i) {
-    if (buffer[i] == '\0')
-      break;
-    if (buffer[i] == '(')
-      ++parens;
-    if (parens > 0) {
-      if (buffer[i] == ')')
-        --parens;
-    } else if (buffer[i] == ' ') {
-      std::string_view field_string{buffer + field_start, i - field_start};
-      switch (field) {
-        case 0:
-          pid = std::stoi(std::string{field_string});
-          break;
-        case 3:
-          *ppid = std::stoi(std::string{field_string});
-          break;
-        case 4:
-          *sid = std::stoi(std::string{field_string});
-          break;
-        default:
-          break;
+  void begin() {
+    snapshot_.clear();
+    records_.clear();
+    cpu_masks_.clear();
+    cpu_mask_indices_.clear();
+    strings_.clear();
+    interned_.clear();
+    string_offsets_.clear();
+
+    timespec now;
+    PCHECK(clock_gettime(CLOCK_REALTIME, &now));
+    capture_time_ = now.tv_sec * uint64_t{1'000'000'000} + now.tv_nsec;
+  }
+
+  void add(const TaskRecord& task) {
+    dump_rtprio::SnapshotRecord& record = records_.emplace_back();
+    record.exe = intern(task.exe);
+    record.name = intern(task.name);
+    record.cpu_mask = intern(task.cpu_mask);
+    record.policy = task.policy;
+    record.nice = task.nice;
+    record.priority = task.priority;
+    record.tid = task.tid;
+    record.pid = task.pid;
+    record.ppid = task.ppid;
+    record.sid = task.sid;
+    record.cpu = task.cpu;
+    record.reserved = 0;
+    record.starttime = task.starttime;
+  }
+
+  // Returns the snapshot of the tasks added since begin(). It's valid until the
+  // next begin().
+  std::string_view finish() {
+    dump_rtprio::SnapshotHeader header{};
+    std::copy_n(dump_rtprio::kSnapshotMagic, sizeof(header.magic),
+                header.magic);
+    header.version = dump_rtprio::kSnapshotVersion;
+    header.byte_order = dump_rtprio::kSnapshotByteOrder;
+    header.header_size = sizeof(header);
+    header.record_size = sizeof(dump_rtprio::SnapshotRecord);
+    header.boot_time = system_.boot_time;
+    header.capture_time = capture_time_;
+    header.pid_max = system_.pid_max;
+    header.nproc = system_.nproc;
+    header.record_count = records_.size();
+    header.cpu_mask_count = cpu_mask_indices_.size();
+    header.cpu_mask_words = mask_words();
+    header.records_offset = sizeof(header);
+    header.cpu_masks_offset =
+        header.records_offset +
+        records_.size() * sizeof(dump_rtprio::SnapshotRecord);
+    header.strings_offset =
+        header.cpu_masks_offset + cpu_masks_.size() * sizeof(uint64_t);
+    header.strings_size = strings_.size();
+
+    // Pad the string table so back-to-back snapshots stay 8-byte aligned.
+    strings_.resize((strings_.size() + 7) / 8 * 8, '\0');
+
+    append_bytes(&header, sizeof(header));
+    append_bytes(records_.data(),
+                 records_.size() * sizeof(dump_rtprio::SnapshotRecord));
+    append_bytes(cpu_masks_.data(), cpu_masks_.size() * sizeof(uint64_t));
+    snapshot_.append(strings_);
+    return snapshot_;
+  }
+
+ private:
+  const System& system_;
+  uint64_t capture_time_ = 0;
+  std::string snapshot_;
+
+  std::vector<dump_rtprio::SnapshotRecord> records_;
+
+  // The distinct masks, packed into uint64_t words so the layout doesn't
+  // depend on the size of unsigned long.
+  std::vector<uint64_t> cpu_masks_;
+  std::map<CpuMask, uint32_t> cpu_mask_indices_;
+
+  // The keys point into interned_, whose strings outlive the tasks'.
+  std::string strings_;
+  StringTable interned_;
+  std::unordered_map<std::string_view, uint32_t> string_offsets_;
+
+  size_t mask_words() const {
+    return (system_.cpu_mask_words * kBitsPerWord + 63) / 64;
+  }
+
+  void append_bytes(const void* data, size_t size) {
+    snapshot_.append(static_cast<const char*>(data), size);
+  }
+
+  uint32_t intern(std::string_view str) {
+    const auto it = string_offsets_.find(str);
+    if (it != string_offsets_.end()) {
+      return it->second;
+    }
+
+    const uint32_t offset = strings_.size();
+    string_offsets_.emplace(interned_.intern(str), offset);
+    strings_.append(str);
+    strings_.push_back('\0');
+    return offset;
+  }
+
+  uint32_t intern(const CpuMask& mask) {
+    const auto [it, inserted] =
+        cpu_mask_indices_.try_emplace(mask, cpu_mask_indices_.size());
+    if (inserted) {
+      const size_t begin = cpu_masks_.size();
+      cpu_masks_.resize(begin + mask_words());
+      for (size_t i = 0; i < mask.size(); ++i) {
+        const int bit = i * kBitsPerWord;
+        cpu_masks_[begin + bit / 64] |= uint64_t{mask[i]} << (bit % 64);
       }
-      ++field;
-      field_start = i + 1;
     }
+    return it->second;
   }
-  PCHECK(std::fclose(stat));
+};
 
-  if (field < 4) {
-    LOG(FATAL, "couldn't get fields from /proc/%d/stat\n", process);
+// Writes tasks in the layout described in snapshot_format.h.
+class BinaryWriter : public OutputBackend {
+ public:
+  BinaryWriter(int fd, const System& system) : out_{fd}, builder_{system} {}
+
+  void begin() override { builder_.begin(); }
+
+  void write_task(const TaskRecord& task) override { builder_.add(task); }
+
+  void end() override {
+    out_.append(builder_.finish());
+    out_.flush();
   }
-  CHECK_EQ(pid, process);
-}
 
-void read_status(int process, int ppid, int* pgrp, std::string* name,
-                 bool* not_there) {
-  std::string status_filename = "/proc/" + std::to_string(process) + "/status";
-  std::FILE* status = std::fopen(status_filename.c_str(), "r");
+ private:
+  OutputBuffer out_;
+  SnapshotBuilder builder_;
+};
 
-  if (status == nullptr && errno == ENOENT) {
-    *not_there = true;
-    return;
+// Publishes each snapshot in a POSIX shared memory object laid out as a
+// dump_rtprio::SnapshotRegion, for readers that map it.
+class SharedMemoryWriter : public OutputBackend {
+ public:
+  // Creates the object if it doesn't exist and sizes it to hold snapshots of
+  // up to capacity bytes.
+  SharedMemoryWriter(const char* name, size_t capacity, const System& system)
+      : builder_{system}, capacity_{capacity} {
+    const int fd = shm_open(name, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd == -1) {
+      PLOG(FATAL, "shm_open(\"%s\")", name);
+    }
+    size_ = sizeof(dump_rtprio::SnapshotRegion) + capacity;
+    if (ftruncate(fd, size_) != 0) {
+      PLOG(FATAL, "ftruncate(\"%s\", %zu)", name, size_);
+    }
+    void* const data =
+        mmap(nullptr, size_, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (data == MAP_FAILED) {
+      PLOG(FATAL, "mmap(\"%s\", %zu)", name, size_);
+    }
+    PCHECK(close(fd));
+
+    // Readers check the magic, so it's written last. A previous daemon's
+    // sequence is kept so readers that mapped it see the new snapshots as
+    // newer.
+    region_ = static_cast<dump_rtprio::SnapshotRegion*>(data);
+    uint32_t sequence = region_->sequence.load(std::memory_order_relaxed);
+    sequence += sequence % 2;
+    region_->sequence.store(sequence, std::memory_order_relaxed);
+    region_->version = dump_rtprio::kSnapshotRegionVersion;
+    region_->capacity = capacity;
+    std::atomic_thread_fence(std::memory_order_release);
+    std::copy_n(dump_rtprio::kSnapshotRegionMagic, sizeof(region_->magic),
+                region_->magic);
   }
-  if (status == nullptr) {
-    PLOG(FATAL, "fopen(%s, \"r\")", status_filename.c_str());
+
+  SharedMemoryWriter(const SharedMemoryWriter&) = delete;
+  SharedMemoryWriter& operator=(const SharedMemoryWriter&) = delete;
+
+  ~SharedMemoryWriter() override { PCHECK(munmap(region_, size_)); }
+
+  void begin() override { builder_.begin(); }
+
+  void write_task(const TaskRecord& task) override { builder_.add(task); }
+
+  // Copies the snapshot in while the sequence is odd, so the window readers
+  // retry in is just the memcpy().
+  void end() override {
+    const std::string_view snapshot = builder_.finish();
+    if (snapshot.size() > capacity_) {
+      LOG(WARNING,
+          "a %zu byte snapshot doesn't fit in %zu bytes, so the previous one "
+          "is left in place",
+          snapshot.size(), capacity_);
+      return;
+    }
+
+    const uint32_t sequence = region_->sequence.load(std::memory_order_relaxed);
+    region_->sequence.store(sequence + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    std::memcpy(region_->snapshot(), snapshot.data(), snapshot.size());
+    region_->size = snapshot.size();
+    region_->sequence.store(sequence + 2, std::memory_order_release);
   }
 
-  int pid = 0;
-  int status_ppid = 0;
-  while (true) {
-    char buffer[1024];
-    if (std::fgets(buffer, sizeof(buffer), status) == nullptr) {
-      if (std::ferror(status)) {
-        PLOG(FATAL, "fgets(%p, %zu, %p)", buffer, sizeof(buffer), status);
-      } else {
-        break;
-      }
+ private:
+  SnapshotBuilder builder_;
+  dump_rtprio::SnapshotRegion* region_ = nullptr;
+  size_t capacity_;
+
+  // Of the whole mapping.
+  size_t size_ = 0;
+};
+
+// Sends frames in the layout described in snapshot_format.h to a collector at
+// a URL like udp://10.0.0.5:5800 or tcp://[fd00::1]:5800. Each scan is
+// encoded against a copy of the tasks in the previous one, so an idle system
+// costs little more than a header per scan.
+class StreamWriter : public OutputBackend {
+ public:
+  // Connecting and sending give up after timeout, so an unreachable collector
+  // delays the next scan by at most that much.
+  StreamWriter(const char* url, timespec timeout, const System& system)
+      : mask_words_{(system.cpu_mask_words * kBitsPerWord + 63) / 64},
+        boot_time_{system.boot_time} {
+    std::string_view rest = url;
+    if (rest.starts_with("udp://")) {
+      type_ = SOCK_DGRAM;
+    } else if (rest.starts_with("tcp://")) {
+      type_ = SOCK_STREAM;
     }
-    std::string_view line{buffer};
-    if (line.starts_with("Name:")) {
-      line.remove_prefix(sizeof("Name:"));
-      *name = strip(line);
-    } else if (line.starts_with("Pid:")) {
-      line.remove_prefix(sizeof("Pid:"));
-      pid = std::stoi(std::string{strip(line)});
-    } else if (line.starts_with("PPid:")) {
-      line.remove_prefix(sizeof("PPid:"));
-      status_ppid = std::stoi(std::string{strip(line)});
-    } else if (line.starts_with("Tgid:")) {
-      line.remove_prefix(sizeof("Tgid:"));
-      *pgrp = std::stoi(std::string{strip(line)});
+    rest.remove_prefix(std::min(rest.size(), size_t{6}));
+    const size_t colon = rest.rfind(':');
+    if (type_ == -1 || colon == std::string_view::npos || colon == 0 ||
+        colon + 1 == rest.size()) {
+      LOG(FATAL,
+          "--stream: expected udp://HOST:PORT or tcp://HOST:PORT, got \"%s\"",
+          url);
+    }
+    std::string_view host = rest.substr(0, colon);
+    if (host.size() >= 2 && host.front() == '[' && host.back() == ']') {
+      host = host.substr(1, host.size() - 2);
+    }
+
+    // Only numeric addresses are taken. Resolving names would need glibc's NSS
+    // modules, which a static binary can't link in.
+    const std::string address{host};
+    const std::string_view port = rest.substr(colon + 1);
+    uint16_t port_number = 0;
+    const auto [end, ec] =
+        std::from_chars(port.data(), port.data() + port.size(), port_number);
+    if (ec != std::errc{} || end != port.data() + port.size() ||
+        port_number == 0) {
+      LOG(FATAL, "--stream: %s: invalid port", url);
+    }
+    auto ipv4 = reinterpret_cast<sockaddr_in*>(&address_);
+    auto ipv6 = reinterpret_cast<sockaddr_in6*>(&address_);
+    if (inet_pton(AF_INET, address.c_str(), &ipv4->sin_addr) == 1) {
+      ipv4->sin_family = AF_INET;
+      ipv4->sin_port = htons(port_number);
+      address_size_ = sizeof(sockaddr_in);
+    } else if (inet_pton(AF_INET6, address.c_str(), &ipv6->sin6_addr) == 1) {
+      ipv6->sin6_family = AF_INET6;
+      ipv6->sin6_port = htons(port_number);
+      address_size_ = sizeof(sockaddr_in6);
+    } else {
+      LOG(FATAL, "--stream: %s: HOST must be an IPv4 or IPv6 address", url);
+    }
+    family_ = address_.ss_family;
+
+    // A zero SO_SNDTIMEO would mean never giving up.
+    timeout_.tv_sec = timeout.tv_sec;
+    timeout_.tv_usec = timeout.tv_nsec / 1000;
+    if (timeout_.tv_sec == 0 && timeout_.tv_usec == 0) {
+      timeout_.tv_usec = 1;
     }
   }
 
-  PCHECK(std::fclose(status));
-  CHECK_EQ(pid, process);
-  CHECK_EQ(status_ppid, ppid);
-}
+  StreamWriter(const StreamWriter&) = delete;
+  StreamWriter& operator=(const StreamWriter&) = delete;
 
-}  // namespace
+  ~StreamWriter() override { disconnect(); }
 
-int main() {
-  std::printf("exe,name,cpumask,policy,nice,priority,tid,pid,ppid,sid,cpu\n");
+  void begin() override {
+    frame_.resize(sizeof(dump_rtprio::StreamFrameHeader));
+    entry_count_ = 0;
+    last_tid_ = 0;
+    keyframe_ = resync_ || scans_++ % dump_rtprio::kStreamKeyframeInterval == 0;
+    first_frame_ = true;
+    scan_failed_ = false;
+    if (keyframe_) {
+      old_count_ = 0;
+    }
+    next_old_ = 0;
+    new_count_ = 0;
+
+    timespec now;
+    PCHECK(clock_gettime(CLOCK_REALTIME, &now));
+    capture_time_ = now.tv_sec * uint64_t{1'000'000'000} + now.tv_nsec;
+  }
+
+  // Tasks arrive in TID order, so they're merged with the previous scan's,
+  // which are too.
+  void write_task(const TaskRecord& task) override {
+    for (; next_old_ < old_count_ && old_[next_old_].tid < task.tid;
+         ++next_old_) {
+      write_entry(old_[next_old_], 0);
+    }
+    const SentTask* old = nullptr;
+    if (next_old_ < old_count_ && old_[next_old_].tid == task.tid) {
+      old = &old_[next_old_++];
+    }
 
-  const int pid_max = find_pid_max();
-  const cpu_set_t all_cpus = find_all_cpus();
+    if (new_count_ == new_.size()) {
+      new_.emplace_back();
+    }
+    SentTask& sent = new_[new_count_++];
+    sent.assign(task, mask_words_);
+    const uint32_t fields = old == nullptr ? dump_rtprio::kStreamAllFields
+                                           : changed_fields(*old, sent);
+    if (fields != 0) {
+      write_entry(sent, fields);
+    }
+  }
 
-  for (int i = 0; i < pid_max; ++i) {
-    bool not_there = false;
+  void end() override {
+    for (; next_old_ < old_count_; ++next_old_) {
+      write_entry(old_[next_old_], 0);
+    }
+    std::swap(old_, new_);
+    old_count_ = new_count_;
 
-    const cpu_set_t cpu_mask = find_cpu_mask(i, &not_there);
-    const sched_param param = find_sched_param(i, &not_there);
-    const int scheduler = find_scheduler(i, &not_there);
-    const std::string exe = find_exe(i, &not_there);
-    const int nice_value = find_nice_value(i, &not_there);
+    finish_frame(dump_rtprio::kStreamScanEnd);
 
-    int ppid = 0, sid = 0;
-    read_stat(i, &ppid, &sid, &not_there);
+    // Receivers can't apply anything after a frame they missed but a
+    // keyframe.
+    resync_ = scan_failed_;
+  }
 
-    int pgrp = 0;
+ private:
+  // A task as it was last sent.
+  struct SentTask {
+    std::string exe;
     std::string name;
-    read_status(i, ppid, &pgrp, &name, &not_there);
+    std::vector<uint64_t> cpu_mask;
+    int policy = 0;
+    int nice = 0;
+    int priority = 0;
+    int tid = 0;
+    int pid = 0;
+    int ppid = 0;
+    int sid = 0;
+    int cpu = 0;
+    uint64_t starttime = 0;
 
-    if (not_there) {
-      continue;
+    // Reuses the strings and mask, so this only allocates when they grow.
+    void assign(const TaskRecord& task, size_t mask_words) {
+      exe.assign(task.exe);
+      name.assign(task.name);
+      cpu_mask.assign(mask_words, 0);
+      for (size_t i = 0; i < task.cpu_mask.size(); ++i) {
+        const int bit = i * kBitsPerWord;
+        cpu_mask[bit / 64] |= uint64_t{task.cpu_mask[i]} << (bit % 64);
+      }
+      policy = task.policy;
+      nice = task.nice;
+      priority = task.priority;
+      tid = task.tid;
+      pid = task.pid;
+      ppid = task.ppid;
+      sid = task.sid;
+      cpu = task.cpu;
+      starttime = task.starttime;
     }
+  };
 
-    const char* cpu_mask_string =
-        CPU_EQUAL(&cpu_mask, &all_cpus) ? "all" : "???";
+  static uint32_t changed_fields(const SentTask& old, const SentTask& task) {
+    uint32_t fields = 0;
+    const auto check = [&](bool changed, dump_rtprio::StreamField field) {
+      fields |= changed ? field : 0u;
+    };
+    check(old.exe != task.exe, dump_rtprio::kStreamExe);
+    check(old.name != task.name, dump_rtprio::kStreamName);
+    check(old.cpu_mask != task.cpu_mask, dump_rtprio::kStreamCpuMask);
+    check(old.policy != task.policy, dump_rtprio::kStreamPolicy);
+    check(old.nice != task.nice, dump_rtprio::kStreamNice);
+    check(old.priority != task.priority, dump_rtprio::kStreamPriority);
+    check(old.pid != task.pid, dump_rtprio::kStreamPid);
+    check(old.ppid != task.ppid, dump_rtprio::kStreamPpid);
+    check(old.sid != task.sid, dump_rtprio::kStreamSid);
+    check(old.cpu != task.cpu, dump_rtprio::kStreamCpu);
+    check(old.starttime != task.starttime, dump_rtprio::kStreamStarttime);
+    return fields;
+  }
 
-    std::printf("%s,%s,%s,%s,%d,%d,%d,%d,%d,%d\n", exe.c_str(), name.c_str(),
-                cpu_mask_string, policy_string(scheduler), nice_value,
-                param.sched_priority, i, pgrp, ppid, sid);
+  void append_varint(uint64_t value) {
+    while (value >= 0x80) {
+      entry_.push_back(static_cast<char>(value | 0x80));
+      value >>= 7;
+    }
+    entry_.push_back(static_cast<char>(value));
   }
-}
+
+  void append_string(std::string_view str) {
+    append_varint(str.size());
+    entry_.append(str);
+  }
+
+  // Writes task's fields in fields, or that it exited if fields is 0. Over
+  // UDP, a frame without room for the entry is sent first, and the entry is
+  // encoded again since its TID is relative to the new frame's first.
+  void write_entry(const SentTask& task, uint32_t fields) {
+    encode_entry(task, fields);
+    if (type_ == SOCK_DGRAM && entry_count_ > 0 &&
+        frame_.size() + entry_.size() > dump_rtprio::kStreamMaxDatagram) {
+      finish_frame(0);
+      encode_entry(task, fields);
+    }
+    frame_.append(entry_);
+    ++entry_count_;
+    last_tid_ = task.tid;
+  }
+
+  void encode_entry(const SentTask& task, uint32_t fields) {
+    entry_.clear();
+    append_varint(task.tid - last_tid_);
+    append_varint(fields);
+    if (fields & dump_rtprio::kStreamExe) {
+      append_string(task.exe);
+    }
+    if (fields & dump_rtprio::kStreamName) {
+      append_string(task.name);
+    }
+    if (fields & dump_rtprio::kStreamCpuMask) {
+      append_varint(task.cpu_mask.size());
+      for (uint64_t word : task.cpu_mask) {
+        append_varint(word);
+      }
+    }
+    if (fields & dump_rtprio::kStreamPolicy) {
+      append_varint(task.policy);
+    }
+    if (fields & dump_rtprio::kStreamNice) {
+      // Zigzag encoded.
+      append_varint((static_cast<uint32_t>(task.nice) << 1) ^
+                    static_cast<uint32_t>(task.nice >> 31));
+    }
+    if (fields & dump_rtprio::kStreamPriority) {
+      append_varint(task.priority);
+    }
+    if (fields & dump_rtprio::kStreamPid) {
+      append_varint(task.pid);
+    }
+    if (fields & dump_rtprio::kStreamPpid) {
+      append_varint(task.ppid);
+    }
+    if (fields & dump_rtprio::kStreamSid) {
+      append_varint(task.sid);
+    }
+    if (fields & dump_rtprio::kStreamCpu) {
+      append_varint(task.cpu);
+    }
+    if (fields & dump_rtprio::kStreamStarttime) {
+      append_varint(task.starttime);
+    }
+  }
+
+  // Sends the entries written since the last frame as one with flags, and
+  // starts the next. Once a frame of a scan fails, the rest of the scan isn't
+  // sent, since receivers can't apply it until the next keyframe anyway.
+  void finish_frame(uint32_t flags) {
+    dump_rtprio::StreamFrameHeader header{};
+    std::copy_n(dump_rtprio::kStreamMagic, sizeof(header.magic),
+                header.magic);
+    header.version = dump_rtprio::kStreamVersion;
+    header.byte_order = dump_rtprio::kSnapshotByteOrder;
+    header.header_size = sizeof(header);
+    header.flags =
+        flags | (keyframe_ && first_frame_ ? dump_rtprio::kStreamKeyframe : 0);
+    header.entry_count = entry_count_;
+    header.entries_size = frame_.size() - sizeof(header);
+    header.sequence = sequence_++;
+    header.capture_time = capture_time_;
+    header.boot_time = boot_time_;
+    std::memcpy(frame_.data(), &header, sizeof(header));
+
+    if (!scan_failed_) {
+      scan_failed_ = !send_frame();
+    }
+    first_frame_ = false;
+    frame_.resize(sizeof(header));
+    entry_count_ = 0;
+    last_tid_ = 0;
+  }
+
+  // Returns whether the whole frame was sent. Only the first of a run of
+  // failures is logged, since they repeat every frame while the collector is
+  // down.
+  bool send_frame() {
+    if (fd_ == -1 && !connect_socket()) {
+      return false;
+    }
+    const ssize_t sent =
+        send(fd_, frame_.data(), frame_.size(), MSG_NOSIGNAL);
+    count_syscalls(1);
+    if (sent == static_cast<ssize_t>(frame_.size())) {
+      failing_ = false;
+      return true;
+    }
+    warn("send()", sent == -1 ? std::strerror(errno)
+                              : "timed out partway through a frame");
+
+    // A partial frame leaves a TCP receiver out of step with the stream, so
+    // it's started over with a new connection.
+    if (type_ == SOCK_STREAM) {
+      disconnect();
+    }
+    return false;
+  }
+
+  bool connect_socket() {
+    fd_ = socket(family_, type_ | SOCK_CLOEXEC, 0);
+    if (fd_ == -1) {
+      PLOG(FATAL, "socket()");
+    }
+    PCHECK(setsockopt(fd_, SOL_SOCKET, SO_SNDTIMEO, &timeout_,
+                      sizeof(timeout_)));
+    const int result = connect(
+        fd_, reinterpret_cast<const sockaddr*>(&address_), address_size_);
+    count_syscalls(3);
+    if (result != 0) {
+      warn("connect()", std::strerror(errno));
+      disconnect();
+      return false;
+    }
+    return true;
+  }
+
+  void disconnect() {
+    if (fd_ != -1) {
+      PCHECK(close(fd_));
+      fd_ = -1;
+    }
+  }
+
+  void warn(const char* call, const char* error) {
+    if (!failing_) {
+      LOG(WARNING, "--stream: %s: %s", call, error);
+      failing_ = true;
+    }
+  }
+
+  size_t mask_words_;
+  uint64_t boot_time_;
+
+  int type_ = -1;
+  int family_ = AF_UNSPEC;
+  sockaddr_storage address_{};
+  socklen_t address_size_ = 0;
+  timeval timeout_{};
+  int fd_ = -1;
+  bool failing_ = false;
+
+  // The frame being written, and the entry being added to it.
+  std::string frame_;
+  std::string entry_;
+  uint64_t sequence_ = 0;
+  uint64_t scans_ = 0;
+  uint64_t capture_time_ = 0;
+  uint32_t entry_count_ = 0;
+  int last_tid_ = 0;
+  bool keyframe_ = false;
+  bool first_frame_ = false;
+  bool scan_failed_ = false;
+  bool resync_ = false;
+
+  // The previous scan's tasks and this one's, swapped at the end of each
+  // scan. Only the first *_count_ of each are in use, so their strings and
+  // masks are reused.
+  std::vector<SentTask> old_;
+  std::vector<SentTask> new_;
+  size_t old_count_ = 0;
+  size_t new_count_ = 0;
+
+  // The first of old_ that hasn't been merged with this scan's tasks yet.
+  size_t next_old_ = 0;
+};
+
+// Writes each process on a line with its exe and command line, followed by an
+// indented line for each of its threads.
+class TreeWriter : public OutputBackend {
+ public:
+  TreeWriter(int fd, CpuMaskFormatter::Format cpu_mask_format)
+      : out_{fd}, formatter_{cpu_mask_format} {}
+
+  void begin() override { tasks_.clear(); }
+
+  // Tasks arrive in TID order, which interleaves processes, so they're all
+  // held until end().
+  void write_task(const TaskRecord& task) override { tasks_.push_back(task); }
+
+  void end() override {
+    std::stable_sort(
+        tasks_.begin(), tasks_.end(),
+        [](const TaskRecord& a, const TaskRecord& b) { return a.pid < b.pid; });
+
+    for (size_t i = 0; i < tasks_.size(); ++i) {
+      const TaskRecord& task = tasks_[i];
+      if (i == 0 || tasks_[i - 1].pid != task.pid) {
+        out_.append_int(task.pid);
+        out_.append(' ');
+        out_.append(task.exe);
+        if (!task.cmdline.empty()) {
+          out_.append(' ');
+          out_.append(task.cmdline);
+        }
+        out_.append(" ppid=");
+        out_.append_int(task.ppid);
+        out_.append(" sid=");
+        out_.append_int(task.sid);
+        out_.append('\n');
+      }
+
+      out_.append("  ");
+      out_.append_int(task.tid);
+      out_.append(' ');
+      out_.append(task.name);
+      out_.append(" policy=");
+      out_.append(policy_string(task.policy));
+      out_.append(" priority=");
+      out_.append_int(task.priority);
+      out_.append(" nice=");
+      out_.append_int(task.nice);
+      out_.append(" cpumask=");
+      out_.append(formatter_.format(task.cpu_mask));
+      out_.append(" cpu=");
+      out_.append_int(task.cpu);
+      out_.append('\n');
+    }
+    out_.flush();
+  }
+
+ private:
+  OutputBuffer out_;
+  CpuMaskFormatter formatter_;
+  std::vector<TaskRecord> tasks_;
+};
+
+// Counts tasks by policy, priority, and each CPU in their cpumask as they're
+// written, and keeps only the top highest-priority ones, so what it holds
+// doesn't grow with the number of tasks. end() prints each table as CSV, with
+// a blank line between them.
+class SummaryWriter : public OutputBackend {
+ public:
+  // The most top tasks it keeps, since they're all allocated up front and each
+  // insertion moves the ones below it.
+  static constexpr int kMaxTop = 10000;
+
+  SummaryWriter(int fd, int top, const System& system)
+      : out_{fd}, cpu_counts_(system.nproc), top_(top) {}
+
+  void begin() override {
+    policy_counts_.fill(0);
+    priority_counts_.fill(0);
+    std::fill(cpu_counts_.begin(), cpu_counts_.end(), 0);
+    top_count_ = 0;
+  }
+
+  void write_task(const TaskRecord& task) override {
+    if (task.policy >= 0 &&
+        static_cast<size_t>(task.policy) < policy_counts_.size()) {
+      ++policy_counts_[task.policy];
+    }
+    ++priority_counts_[std::clamp(task.priority, 0,
+                                  static_cast<int>(kNumPriorities) - 1)];
+    for (size_t i = 0; i < task.cpu_mask.size(); ++i) {
+      for (unsigned long word = task.cpu_mask[i]; word != 0;
+           word &= word - 1) {
+        const size_t cpu = i * kBitsPerWord + __builtin_ctzl(word);
+        if (cpu < cpu_counts_.size()) {
+          ++cpu_counts_[cpu];
+        }
+      }
+    }
+    add_top(task);
+  }
+
+  void end() override {
+    out_.append("policy,tasks\n");
+    for (size_t policy = 0; policy < policy_counts_.size(); ++policy) {
+      write_count(policy_string(policy), policy_counts_[policy]);
+    }
+
+    out_.append("\npriority,tasks\n");
+    for (size_t priority = 0; priority < kNumPriorities; ++priority) {
+      if (priority_counts_[priority] != 0) {
+        out_.append_int(priority);
+        out_.append(',');
+        out_.append_int(priority_counts_[priority]);
+        out_.append('\n');
+      }
+    }
+
+    out_.append("\ncpu,tasks\n");
+    for (size_t cpu = 0; cpu < cpu_counts_.size(); ++cpu) {
+      out_.append_int(cpu);
+      out_.append(',');
+      out_.append_int(cpu_counts_[cpu]);
+      out_.append('\n');
+    }
+
+    out_.append("\nname,policy,nice,priority,tid,pid\n");
+    for (size_t i = 0; i < top_count_; ++i) {
+      const TopTask& task = top_[i];
+      out_.append(std::string_view{task.name, task.name_size});
+      out_.append(',');
+      out_.append(policy_string(task.policy));
+      out_.append(',');
+      out_.append_int(task.nice);
+      out_.append(',');
+      out_.append_int(task.priority);
+      out_.append(',');
+      out_.append_int(task.tid);
+      out_.append(',');
+      out_.append_int(task.pid);
+      out_.append('\n');
+    }
+    out_.flush();
+  }
+
+ private:
+  // Priorities above 99 aren't valid for any policy.
+  static constexpr size_t kNumPriorities = 100;
+
+  // A copy of what's printed for each of the top tasks, since the strings in
+  // a TaskRecord don't outlive it. Longer names are truncated.
+  struct TopTask {
+    int policy;
+    int nice;
+    int priority;
+    int tid;
+    int pid;
+    size_t name_size;
+    char name[64];
+  };
+
+  // Higher priorities first, then lower nice values, then TID order.
+  static bool ranks_before(const TaskRecord& task, const TopTask& other) {
+    if (task.priority != other.priority) {
+      return task.priority > other.priority;
+    }
+    if (task.nice != other.nice) {
+      return task.nice < other.nice;
+    }
+    return task.tid < other.tid;
+  }
+
+  // Inserts task into the sorted top_ if it ranks in it, dropping the last.
+  void add_top(const TaskRecord& task) {
+    size_t i = top_count_;
+    if (i == top_.size()) {
+      if (i == 0 || !ranks_before(task, top_[i - 1])) {
+        return;
+      }
+      --i;
+    } else {
+      ++top_count_;
+    }
+    for (; i > 0 && ranks_before(task, top_[i - 1]); --i) {
+      top_[i] = top_[i - 1];
+    }
+
+    TopTask& top = top_[i];
+    top.policy = task.policy;
+    top.nice = task.nice;
+    top.priority = task.priority;
+    top.tid = task.tid;
+    top.pid = task.pid;
+    top.name_size = std::min(task.name.size(), sizeof(top.name));
+    std::memcpy(top.name, task.name.data(), top.name_size);
+  }
+
+  void write_count(const char* key, uint32_t count) {
+    if (count != 0) {
+      out_.append(key);
+      out_.append(',');
+      out_.append_int(count);
+      out_.append('\n');
+    }
+  }
+
+  OutputBuffer out_;
+
+  // Indexed by SCHED_* constant, priority, and CPU.
+  std::array<uint32_t, 32> policy_counts_{};
+  std::array<uint32_t, kNumPriorities> priority_counts_{};
+  std::vector<uint32_t> cpu_counts_;
+
+  // Sized once, with the first top_count_ in use.
+  std::vector<TopTask> top_;
+  size_t top_count_ = 0;
+};
+
+// Subscribes to the kernel's proc connector, which sends an event whenever a
+// task forks, execs, exits, or changes its name. That takes CAP_NET_ADMIN in
+// the initial user and PID namespaces, since events carry the kernel's TIDs.
+// Nothing is sent when a task's scheduling parameters change, so those are
+// still only seen by rescanning.
+class ProcConnector {
+ public:
+  ProcConnector() = default;
+
+  ProcConnector(const ProcConnector&) = delete;
+  ProcConnector& operator=(const ProcConnector&) = delete;
+
+  ~ProcConnector() {
+    if (fd_ != -1) {
+      PCHECK(close(fd_));
+    }
+  }
+
+  // Returns true if it subscribed, or logs a warning saying why not and
+  // returns false.
+  bool open() {
+    fd_ = socket(AF_NETLINK, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                 NETLINK_CONNECTOR);
+    if (fd_ == -1) {
+      LOG(WARNING, "socket(NETLINK_CONNECTOR): %s", std::strerror(errno));
+      return false;
+    }
+
+    sockaddr_nl address{};
+    address.nl_family = AF_NETLINK;
+    address.nl_groups = CN_IDX_PROC;
+    if (bind(fd_, reinterpret_cast<sockaddr*>(&address), sizeof(address)) !=
+        0) {
+      LOG(WARNING, "bind(CN_IDX_PROC): %s", std::strerror(errno));
+      return false;
+    }
+
+    // cn_msg ends in a flexible array, so the request is built in place.
+    constexpr size_t kRequestSize =
+        NLMSG_LENGTH(sizeof(cn_msg) + sizeof(proc_cn_mcast_op));
+    alignas(nlmsghdr) char request[kRequestSize] = {};
+    auto* header = reinterpret_cast<nlmsghdr*>(request);
+    header->nlmsg_len = kRequestSize;
+    header->nlmsg_type = NLMSG_DONE;
+    header->nlmsg_pid = getpid();
+    auto* message = static_cast<cn_msg*>(NLMSG_DATA(header));
+    message->id = {CN_IDX_PROC, CN_VAL_PROC};
+    message->len = sizeof(proc_cn_mcast_op);
+    const proc_cn_mcast_op op = PROC_CN_MCAST_LISTEN;
+    std::memcpy(message->data, &op, sizeof(op));
+    if (send(fd_, request, kRequestSize, 0) !=
+        static_cast<ssize_t>(kRequestSize)) {
+      LOG(WARNING, "send(PROC_CN_MCAST_LISTEN): %s", std::strerror(errno));
+      return false;
+    }
+
+    // The kernel acknowledges with an event whose err says whether it's
+    // allowed, except outside the initial PID namespace where it silently
+    // ignores the request.
+    pollfd poll_fd = {fd_, POLLIN, 0};
+    if (poll(&poll_fd, 1, 1000) != 1) {
+      LOG(WARNING,
+          "the proc connector didn't acknowledge PROC_CN_MCAST_LISTEN");
+      return false;
+    }
+    bool acked = false;
+    uint32_t error = 0;
+    for_each_event(nullptr, [&](const proc_event& event) {
+      if (event.what == proc_event::PROC_EVENT_NONE) {
+        acked = true;
+        error = event.event_data.ack.err;
+      }
+    });
+    if (!acked || error != 0) {
+      LOG(WARNING, "PROC_CN_MCAST_LISTEN: %s",
+          acked ? std::strerror(error) : "not acknowledged");
+      return false;
+    }
+    return true;
+  }
+
+  int fd() const { return fd_; }
+
+  // Appends the tasks that were created or changed since the last call to
+  // *tids and the TIDs of the ones that exited to *exited. Returns false if
+  // the kernel dropped events because they arrived faster than they were
+  // read, in which case a rescan is needed to catch up.
+  bool read_events(std::vector<TaskId>* tids, std::vector<int>* exited) {
+    bool overrun = false;
+    for_each_event(&overrun, [&](const proc_event& event) {
+      switch (event.what) {
+        case proc_event::PROC_EVENT_FORK:
+          tids->push_back({static_cast<int>(event.event_data.fork.child_pid),
+                           static_cast<int>(event.event_data.fork.child_tgid)});
+          break;
+        case proc_event::PROC_EVENT_EXEC:
+          tids->push_back(
+              {static_cast<int>(event.event_data.exec.process_pid),
+               static_cast<int>(event.event_data.exec.process_tgid)});
+          break;
+        case proc_event::PROC_EVENT_EXIT:
+          // The task stays in /proc as a zombie until it's reaped, which
+          // there's no event for, so it's treated as gone now.
+          exited->push_back(event.event_data.exit.process_pid);
+          break;
+        case proc_event::PROC_EVENT_COMM:
+          tids->push_back(
+              {static_cast<int>(event.event_data.comm.process_pid),
+               static_cast<int>(event.event_data.comm.process_tgid)});
+          break;
+        default:
+          break;
+      }
+    });
+    return !overrun;
+  }
+
+ private:
+  int fd_ = -1;
+
+  // Calls func with each event that has arrived until there aren't any more.
+  // Sets *overrun if the kernel dropped some.
+  template <typename F>
+  void for_each_event(bool* overrun, F&& func) {
+    alignas(nlmsghdr) char buffer[8192];
+    while (true) {
+      const ssize_t size = recv(fd_, buffer, sizeof(buffer), 0);
+      count_syscalls(1, size > 0 ? size : 0);
+      if (size == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        return;
+      }
+      if (size == -1 && errno == ENOBUFS) {
+        if (overrun != nullptr) {
+          *overrun = true;
+        }
+        continue;
+      }
+      if (size == -1 && errno == EINTR) {
+        continue;
+      }
+      if (size == -1) {
+        PLOG(FATAL, "recv(NETLINK_CONNECTOR)");
+      }
+
+      int remaining = size;
+      for (auto* header = reinterpret_cast<nlmsghdr*>(buffer);
+           NLMSG_OK(header, remaining);
+           header = NLMSG_NEXT(header, remaining)) {
+        const auto* message = static_cast<const cn_msg*>(NLMSG_DATA(header));
+        if (header->nlmsg_type != NLMSG_DONE ||
+            message->id.idx != CN_IDX_PROC || message->id.val != CN_VAL_PROC ||
+            message->len < sizeof(proc_event)) {
+          continue;
+        }
+        proc_event event;
+        std::memcpy(&event, message->data, sizeof(event));
+        func(event);
+      }
+    }
+  }
+};
+
+// Returns true if the columns watch mode reports changes in differ.
+bool sched_changed(const TaskRecord& a, const TaskRecord& b) {
+  return a.policy != b.policy || a.priority != b.priority ||
+         a.nice != b.nice || a.cpu_mask != b.cpu_mask ||
+         a.sched_flags != b.sched_flags || a.runtime != b.runtime ||
+         a.deadline != b.deadline || a.period != b.period ||
+         a.util_min != b.util_min || a.util_max != b.util_max ||
+         a.irq_cpus != b.irq_cpus;
+}
+
+// Advances *deadline by interval.
+void advance(const timespec& interval, timespec* deadline) {
+  deadline->tv_sec += interval.tv_sec;
+  deadline->tv_nsec += interval.tv_nsec;
+  if (deadline->tv_nsec >= 1'000'000'000) {
+    deadline->tv_nsec -= 1'000'000'000;
+    ++deadline->tv_sec;
+  }
+}
+
+// Advances *deadline, a CLOCK_MONOTONIC time, by interval and sleeps until it.
+// Scans are paced from the previous deadline rather than from when they
+// finished so how long they take doesn't add up.
+void sleep_until_next(const timespec& interval, timespec* deadline) {
+  advance(interval, deadline);
+  while (const int result = clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME,
+                                            deadline, nullptr)) {
+    if (result != EINTR) {
+      errno = result;
+      PLOG(FATAL, "clock_nanosleep()");
+    }
+  }
+}
+
+// Returns what the task used between the scans that found old and a.
+TaskDelta find_delta(const System& system, const TaskRecord& old,
+                     const TaskRecord& a) {
+  const auto ticks_to_ms = [&](uint64_t ticks) {
+    return ticks * 1000 / system.clock_ticks_per_second;
+  };
+
+  TaskDelta r;
+  r.utime_ms = ticks_to_ms(a.utime - old.utime);
+  r.stime_ms = ticks_to_ms(a.stime - old.stime);
+  r.voluntary_ctxt_switches =
+      a.voluntary_ctxt_switches - old.voluntary_ctxt_switches;
+  r.nonvoluntary_ctxt_switches =
+      a.nonvoluntary_ctxt_switches - old.nonvoluntary_ctxt_switches;
+  r.run_us = (a.run_time - old.run_time) / 1000;
+  r.wait_us = (a.wait_time - old.wait_time) / 1000;
+  r.slices = a.timeslices - old.timeslices;
+  return r;
+}
+
+// The tasks watch, daemon, and stream mode keep between scans. It's updated
+// either by rescanning everything or by collecting just the tasks the proc
+// connector reported events for.
+class TaskTable {
+ public:
+  // Replaces the table with a scan of every task, calling found(old, task) for
+  // each task found and then exited(old) for each task in the table that
+  // wasn't, in TID order. old is the table's entry for the same task, or null
+  // if there wasn't one. A task that reused the TID of one that exited counts
+  // as a different task.
+  template <typename F, typename G>
+  void rescan(const Options& options, const System& system, F&& found,
+              G&& exited) {
+    // The table's tasks point into the previous rescan's collectors and
+    // update strings, so alternate between two sets.
+    const int current = ++rescans_ % 2;
+    updated_strings_[current].clear();
+
+    next_.clear();
+    collect_tasks(options, system, find_tids(options, system),
+                  &collectors_[current], [&](const TaskRecord& task) {
+                    found(find_same(task), task);
+                    next_[task.tid] = task;
+                  });
+
+    exited_.clear();
+    table_.for_each([&](int tid, const TaskRecord& task) {
+      const TaskRecord* current_task = next_.find(tid);
+      if (current_task == nullptr ||
+          current_task->starttime != task.starttime) {
+        exited_.push_back(&task);
+      }
+    });
+    sort_by_tid(&exited_);
+    for (const TaskRecord* task : exited_) {
+      exited(*task);
+    }
+
+    std::swap(table_, next_);
+  }
+
+  // Recollects the given tasks and then removes the ones in gone, calling
+  // found() and exited() like rescan(). Tasks that aren't given are left as
+  // they are.
+  template <typename F, typename G>
+  void update(const Options& options, const System& system,
+              std::vector<TaskId> tids, const std::vector<int>& gone,
+              F&& found, G&& exited) {
+    std::sort(tids.begin(), tids.end(), [](TaskId a, TaskId b) {
+      return a.tid < b.tid;
+    });
+    tids.erase(std::unique(tids.begin(), tids.end(),
+                           [](TaskId a, TaskId b) { return a.tid == b.tid; }),
+               tids.end());
+
+    // Tasks collected here outlive update_collectors_, so their strings are
+    // copied into the table's.
+    StringTable& strings = updated_strings_[rescans_ % 2];
+    size_t next_tid = 0;
+    const auto exit_until = [&](int tid) {
+      for (; next_tid < tids.size() && tids[next_tid].tid < tid; ++next_tid) {
+        if (const TaskRecord* old = table_.find(tids[next_tid].tid)) {
+          exited(*old);
+          table_.erase(tids[next_tid].tid);
+        }
+      }
+    };
+    collect_tasks(options, system, tids, &update_collectors_,
+                  [&](const TaskRecord& task) {
+                    exit_until(task.tid);
+                    ++next_tid;
+
+                    const TaskRecord* old = find_same(task);
+                    if (old == nullptr) {
+                      if (const TaskRecord* reused = table_.find(task.tid)) {
+                        exited(*reused);
+                      }
+                    }
+                    found(old, task);
+                    TaskRecord& entry = table_[task.tid];
+                    entry = task;
+                    entry.exe = strings.intern(task.exe);
+                    entry.name = strings.intern(task.name);
+                    entry.cmdline = strings.intern(task.cmdline);
+                    entry.cgroup = strings.intern(task.cgroup);
+                    entry.cpuset = strings.intern(task.cpuset);
+                    entry.irq_cpus = strings.intern(task.irq_cpus);
+                  });
+    exit_until(std::numeric_limits<int>::max());
+
+    for (int tid : gone) {
+      if (const TaskRecord* old = table_.find(tid)) {
+        exited(*old);
+        table_.erase(tid);
+      }
+    }
+  }
+
+  // Returns the table's tasks in TID order. They're valid until the table
+  // next changes.
+  const std::vector<const TaskRecord*>& sorted() {
+    sorted_.clear();
+    table_.for_each(
+        [&](int, const TaskRecord& task) { sorted_.push_back(&task); });
+    sort_by_tid(&sorted_);
+    return sorted_;
+  }
+
+ private:
+  TidMap<TaskRecord> table_;
+  TidMap<TaskRecord> next_;
+  std::vector<const TaskRecord*> exited_;
+  std::vector<const TaskRecord*> sorted_;
+
+  std::vector<Collector> collectors_[2];
+  std::vector<Collector> update_collectors_;
+  StringTable updated_strings_[2];
+  int rescans_ = 0;
+
+  static void sort_by_tid(std::vector<const TaskRecord*>* tasks) {
+    std::sort(tasks->begin(), tasks->end(),
+              [](const TaskRecord* a, const TaskRecord* b) {
+                return a->tid < b->tid;
+              });
+  }
+
+  // Returns the table's entry for task, or null if it doesn't have one,
+  // including if task reused the TID of an entry that exited.
+  const TaskRecord* find_same(const TaskRecord& task) {
+    const TaskRecord* old = table_.find(task.tid);
+    return old != nullptr && old->starttime == task.starttime ? old : nullptr;
+  }
+};
+
+// Measures what a scan costs this process from when it's constructed, for
+// --scan-stats.
+class ScanReport {
+ public:
+  ScanReport() {
+    PCHECK(clock_gettime(CLOCK_MONOTONIC, &start_));
+    PCHECK(getrusage(RUSAGE_SELF, &start_usage_));
+  }
+
+  // Prints how long the scan took, how much CPU time it used, and how often
+  // this process was preempted during it.
+  void print(size_t tasks) const {
+    timespec end;
+    PCHECK(clock_gettime(CLOCK_MONOTONIC, &end));
+    rusage end_usage;
+    PCHECK(getrusage(RUSAGE_SELF, &end_usage));
+
+    const double cpu_ms = milliseconds(end_usage.ru_utime) +
+                          milliseconds(end_usage.ru_stime) -
+                          milliseconds(start_usage_.ru_utime) -
+                          milliseconds(start_usage_.ru_stime);
+    std::fprintf(stderr,
+                 "scan: %zu tasks in %.3f ms, %.3f ms of CPU time, %ld "
+                 "involuntary context switches\n",
+                 tasks,
+                 (end.tv_sec - start_.tv_sec) * 1e3 +
+                     (end.tv_nsec - start_.tv_nsec) / 1e6,
+                 cpu_ms, end_usage.ru_nivcsw - start_usage_.ru_nivcsw);
+  }
+
+ private:
+  timespec start_;
+  rusage start_usage_;
+
+  static double milliseconds(const timeval& time) {
+    return time.tv_sec * 1e3 + time.tv_usec / 1e3;
+  }
+};
+
+// Keeps table up to date until the process is killed, rescanning every
+// interval. With options.events, tasks the proc connector reports events for
+// are also recollected as soon as the events arrive. found() and exited() are
+// passed to TaskTable, and updated() is called after each change to the table.
+template <typename F, typename G, typename H>
+[[noreturn]] void maintain(const Options& options, const System& system,
+                           const timespec& interval, TaskTable* table,
+                           F&& found, G&& exited, H&& updated) {
+  ProcConnector connector;
+  const bool events = options.events && connector.open();
+  if (options.events && !events) {
+    LOG(WARNING, "falling back to rescanning every interval");
+  }
+
+  std::vector<TaskId> tids;
+  std::vector<int> gone;
+  // Applies the events that have arrived to table. Returns false if the kernel
+  // dropped some, in which case only a rescan can catch up.
+  const auto apply_events = [&] {
+    tids.clear();
+    gone.clear();
+    if (!connector.read_events(&tids, &gone)) {
+      return false;
+    }
+    if (!tids.empty() || !gone.empty()) {
+      table->update(options, system, tids, gone, found, exited);
+      updated();
+    }
+    return true;
+  };
+
+  timespec deadline;
+  PCHECK(clock_gettime(CLOCK_MONOTONIC, &deadline));
+  while (true) {
+    if (options.scan_stats) {
+      const ScanReport report;
+      size_t tasks = 0;
+      table->rescan(
+          options, system,
+          [&](const TaskRecord* old, const TaskRecord& task) {
+            ++tasks;
+            found(old, task);
+          },
+          exited);
+      report.print(tasks);
+    } else {
+      table->rescan(options, system, found, exited);
+    }
+    updated();
+
+    if (!events) {
+      sleep_until_next(interval, &deadline);
+      continue;
+    }
+
+    // The rescan listed /proc when it started, so tasks that were created or
+    // exited after that are caught up on from the events.
+    bool overrun = !apply_events();
+    advance(interval, &deadline);
+    pollfd poll_fd = {connector.fd(), POLLIN, 0};
+    while (!overrun) {
+      timespec now;
+      PCHECK(clock_gettime(CLOCK_MONOTONIC, &now));
+      timespec timeout = {deadline.tv_sec - now.tv_sec,
+                          deadline.tv_nsec - now.tv_nsec};
+      if (timeout.tv_nsec < 0) {
+        timeout.tv_nsec += 1'000'000'000;
+        --timeout.tv_sec;
+      }
+      if (timeout.tv_sec < 0) {
+        break;
+      }
+
+      const int result = ppoll(&poll_fd, 1, &timeout, nullptr);
+      count_syscalls(1);
+      if (result == -1 && errno != EINTR) {
+        PLOG(FATAL, "ppoll()");
+      }
+      if (result != 1) {
+        continue;
+      }
+
+      overrun = !apply_events();
+    }
+  }
+}
+
+// Prints a row for each task that appeared, exited, or had its policy,
+// priority, nice value, or affinity change since the last scan. With
+// options.rates, each row also has what the task used since the last scan,
+// and tasks that used anything get an "active" row even if nothing else
+// changed. Never returns.
+[[noreturn]] void watch(const Options& options, const System& system,
+                        CsvWriter* writer) {
+  const TaskDelta no_delta;
+  const TaskDelta* const zero_delta = options.rates ? &no_delta : nullptr;
+
+  // Each task's TaskDelta::max_wait_us so far, by TID. The starttime tells a
+  // task that reused a TID apart from the one exiting, which rescan() reports
+  // after it.
+  struct MaxWait {
+    uint64_t starttime = 0;
+    uint64_t wait_us = 0;
+  };
+  TidMap<MaxWait> max_waits;
+  const bool track_waits = options.rates && options.needs_schedstat();
+
+  TaskTable table;
+  maintain(
+      options, system, options.watch_interval, &table,
+      [&](const TaskRecord* old, const TaskRecord& task) {
+        if (old == nullptr) {
+          if (track_waits) {
+            max_waits[task.tid] = {task.starttime, 0};
+          }
+          writer->write_event("new", task, zero_delta);
+        } else if (options.rates) {
+          TaskDelta delta = find_delta(system, *old, task);
+          if (track_waits) {
+            MaxWait& max_wait = max_waits[task.tid];
+            max_wait.starttime = task.starttime;
+            max_wait.wait_us = std::max(max_wait.wait_us, delta.wait_us);
+            delta.max_wait_us = max_wait.wait_us;
+          }
+          if (sched_changed(*old, task)) {
+            writer->write_event("changed", task, &delta);
+          } else if (delta.utime_ms != 0 || delta.stime_ms != 0 ||
+                     delta.voluntary_ctxt_switches != 0 ||
+                     delta.nonvoluntary_ctxt_switches != 0 ||
+                     delta.slices != 0) {
+            writer->write_event("active", task, &delta);
+          }
+        } else if (sched_changed(*old, task)) {
+          writer->write_event("changed", task);
+        }
+      },
+      [&](const TaskRecord& old) {
+        const MaxWait* const max_wait =
+            track_waits ? max_waits.find(old.tid) : nullptr;
+        if (max_wait == nullptr || max_wait->starttime != old.starttime) {
+          writer->write_event("exited", old, zero_delta);
+          return;
+        }
+        TaskDelta delta;
+        delta.max_wait_us = max_wait->wait_us;
+        max_waits.erase(old.tid);
+        writer->write_event("exited", old, &delta);
+      },
+      [&] { writer->flush(); });
+}
+
+// Writes every task to writer every options.publish_interval, or with
+// options.events, whenever a task is created or exits. Never returns.
+[[noreturn]] void publish(const Options& options, const System& system,
+                          OutputBackend* writer) {
+  TaskTable table;
+  maintain(
+      options, system, options.publish_interval, &table,
+      [](const TaskRecord*, const TaskRecord&) {}, [](const TaskRecord&) {},
+      [&] {
+        writer->begin();
+        for (const TaskRecord* task : table.sorted()) {
+          writer->write_task(*task);
+        }
+        writer->end();
+      });
+}
+
+std::unique_ptr<OutputBackend> make_backend(const Options& options,
+                                            const System& system, int fd) {
+  if (options.summary) {
+    return std::make_unique<SummaryWriter>(fd, options.top, system);
+  }
+  switch (options.format) {
+    case Options::kBinary:
+      return std::make_unique<BinaryWriter>(fd, system);
+    case Options::kTree:
+      return std::make_unique<TreeWriter>(fd, options.cpu_mask_format);
+    default:
+      return std::make_unique<CsvWriter>(fd, options, system);
+  }
+}
+
+// Runs options.bench full scans, writing the output to /dev/null, then prints
+// how long each phase took and how many syscalls and bytes read each task
+// cost.
+void bench(const Options& options, const System& system) {
+  const int null_fd = open("/dev/null", O_WRONLY | O_CLOEXEC);
+  if (null_fd == -1) {
+    PLOG(FATAL, "open(\"/dev/null\")");
+  }
+  std::unique_ptr<OutputBackend> backend =
+      make_backend(options, system, null_fd);
+
+  ScanStats total;
+  uint64_t vanished = 0;
+  std::vector<Collector> collectors;
+  const uint64_t start = monotonic_ns();
+  for (int i = 0; i < options.bench; ++i) {
+    ScanStats main_stats;
+    current_stats = &main_stats;
+
+    std::vector<TaskId> tids;
+    {
+      PhaseTimer timer{kDiscovery};
+      tids = find_tids(options, system);
+    }
+
+    backend->begin();
+    collect_tasks(options, system, tids, &collectors,
+                  [&](const TaskRecord& task) { backend->write_task(task); });
+    {
+      PhaseTimer timer{kFormat};
+      backend->end();
+    }
+
+    current_stats = nullptr;
+    total.add(main_stats);
+    for (const Collector& collector : collectors) {
+      total.add(collector.stats);
+      vanished += collector.vanished;
+    }
+  }
+  const uint64_t wall_ns = monotonic_ns() - start;
+  PCHECK(close(null_fd));
+
+  const double scans = options.bench;
+  const double tasks = std::max<uint64_t>(total.tasks, 1);
+  std::printf("%d scans, %.1f tasks per scan, %.3f ms per scan\n",
+              options.bench, total.tasks / scans, wall_ns / scans / 1e6);
+  std::printf("\n%-10s %12s %12s\n", "phase", "ms/scan", "us/task");
+  for (int phase = 0; phase < kNumPhases; ++phase) {
+    std::printf("%-10s %12.3f %12.3f\n", kPhaseNames[phase],
+                total.phase_ns[phase] / scans / 1e6,
+                total.phase_ns[phase] / tasks / 1e3);
+  }
+  std::printf("\n%.2f syscalls and %.1f bytes read per task\n",
+              total.syscalls / tasks, total.bytes_read / tasks);
+  std::printf("%.1f tasks per scan vanished before they were collected\n",
+              vanished / scans);
+  if (options.jobs > 1) {
+    std::printf(
+        "(phase times are summed over %d threads, so they can add up to "
+        "more\nthan the wall time)\n",
+        options.jobs);
+  }
+}
+
+// Returns the value of an integer option, exiting if it isn't one.
+int parse_int_option(const char* name, const char* value) {
+  const std::string_view str{value};
+  int r = 0;
+  const auto [ptr, ec] = std::from_chars(str.begin(), str.end(), r);
+  if (ec != std::errc{} || ptr != str.end()) {
+    LOG(FATAL, "--%s: invalid integer \"%s\"", name, value);
+  }
+  return r;
+}
+
+// Returns the value of an option that's a number of seconds, exiting if it
+// isn't one.
+timespec parse_seconds_option(const char* name, const char* value) {
+  const std::string_view str{value};
+  double seconds = 0.0;
+  const auto [ptr, ec] = std::from_chars(str.begin(), str.end(), seconds);
+  if (ec != std::errc{} || ptr != str.end() || !(seconds > 0.0)) {
+    LOG(FATAL, "--%s: invalid number of seconds \"%s\"", name, value);
+  }
+
+  timespec r;
+  r.tv_sec = static_cast<time_t>(seconds);
+  r.tv_nsec = static_cast<long>((seconds - r.tv_sec) * 1e9);
+  return r;
+}
+
+// Returns the SCHED_* constant policy_string() returns name for, or -1 if it
+// isn't one.
+int parse_policy(std::string_view name) {
+  constexpr int kNamedPolicies[] = {
+    SCHED_OTHER, SCHED_BATCH, SCHED_IDLE, SCHED_FIFO, SCHED_RR,
+#ifdef SCHED_DEADLINE
+    SCHED_DEADLINE,
+#endif
+  };
+  for (int policy : kNamedPolicies) {
+    if (name == policy_string(policy)) {
+      return policy;
+    }
+  }
+  return -1;
+}
+
+// What to set a task's scheduling to. -1 or an empty mask leaves that part as
+// it is.
+struct SchedSetting {
+  int policy = -1;
+  int priority = -1;
+  CpuMask cpu_mask;
+};
+
+// A line of an --apply rules file.
+struct Rule {
+  // Matched against the task's name.
+  regex_t name;
+
+  SchedSetting setting;
+};
+
+// Returns the whole contents of path.
+std::string read_file(const char* path) {
+  const int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd == -1) {
+    PLOG(FATAL, "open(\"%s\")", path);
+  }
+
+  std::string r;
+  char buffer[4096];
+  ssize_t size;
+  while ((size = read(fd, buffer, sizeof(buffer))) != 0) {
+    if (size == -1 && errno == EINTR) {
+      continue;
+    }
+    if (size == -1) {
+      PLOG(FATAL, "read(\"%s\")", path);
+    }
+    r.append(buffer, size);
+  }
+  PCHECK(close(fd));
+  return r;
+}
+
+// Splits line into whitespace-separated fields. Returns how many there are, or
+// max_fields + 1 if there are more than max_fields.
+size_t split_fields(std::string_view line, std::string_view* fields,
+                    size_t max_fields) {
+  size_t field_count = 0;
+  while (true) {
+    const size_t start = line.find_first_not_of(" \t\r");
+    if (start == std::string_view::npos) {
+      return field_count;
+    }
+    line.remove_prefix(start);
+    const size_t end = std::min(line.find_first_of(" \t\r"), line.size());
+    if (field_count == max_fields) {
+      return max_fields + 1;
+    }
+    fields[field_count++] = line.substr(0, end);
+    line.remove_prefix(end);
+  }
+}
+
+// Parses a policy, a priority, and a CPU list, with - or a missing field for
+// anything to leave as it is. Errors are fatal and start with context.
+SchedSetting parse_sched_setting(const std::string_view* fields,
+                                 size_t field_count, const System& system,
+                                 const char* context) {
+  SchedSetting setting;
+  const auto given = [&](size_t field) {
+    return field < field_count && fields[field] != "-";
+  };
+
+  if (given(0)) {
+    setting.policy = parse_policy(fields[0]);
+    if (setting.policy == -1) {
+      LOG(FATAL, "%s: unknown policy \"%.*s\"", context,
+          static_cast<int>(fields[0].size()), fields[0].data());
+    }
+  }
+
+  if (given(1)) {
+    const auto [ptr, ec] = std::from_chars(fields[1].begin(), fields[1].end(),
+                                           setting.priority);
+    if (ec != std::errc{} || ptr != fields[1].end() || setting.priority < 0) {
+      LOG(FATAL, "%s: invalid priority \"%.*s\"", context,
+          static_cast<int>(fields[1].size()), fields[1].data());
+    }
+  }
+  // The rest, like DEADLINE, need sched_setattr() and parameters a setting
+  // doesn't have.
+  if (setting.policy != -1 && setting.policy != SCHED_OTHER &&
+      setting.policy != SCHED_BATCH && setting.policy != SCHED_IDLE &&
+      setting.policy != SCHED_FIFO && setting.policy != SCHED_RR) {
+    LOG(FATAL, "%s: %s can't be set with sched_setscheduler()", context,
+        policy_string(setting.policy));
+  }
+  const bool real_time =
+      setting.policy == SCHED_FIFO || setting.policy == SCHED_RR;
+  if (real_time && setting.priority < 1) {
+    LOG(FATAL, "%s: %s needs a priority of at least 1", context,
+        policy_string(setting.policy));
+  }
+  if (setting.policy != -1 && !real_time && setting.priority > 0) {
+    LOG(FATAL, "%s: %s only has priority 0", context,
+        policy_string(setting.policy));
+  }
+
+  if (given(2)) {
+    setting.cpu_mask.resize(system.cpu_mask_words);
+    if (!parse_cpu_list(fields[2], &setting.cpu_mask)) {
+      LOG(FATAL, "%s: invalid CPU list \"%.*s\"", context,
+          static_cast<int>(fields[2].size()), fields[2].data());
+    }
+  }
+
+  return setting;
+}
+
+// Parses an --apply rules file. Each line is a name regex, a policy, a
+// priority, and a CPU list separated by whitespace, with - for anything to
+// leave as it is, except that a - priority is 0 when the policy isn't FIFO or
+// RR. Blank lines and text after a # are ignored.
+std::vector<Rule> read_rules(const char* path, const System& system) {
+  const std::string contents = read_file(path);
+  std::vector<Rule> rules;
+
+  std::string_view rest{contents};
+  for (int line_number = 1; !rest.empty(); ++line_number) {
+    const size_t newline = std::min(rest.find('\n'), rest.size());
+    std::string_view line = rest.substr(0, newline);
+    rest.remove_prefix(std::min(newline + 1, rest.size()));
+    line = line.substr(0, line.find('#'));
+
+    std::string_view fields[4];
+    const size_t field_count = split_fields(line, fields, 4);
+    if (field_count == 0) {
+      continue;
+    }
+    if (field_count != 4) {
+      LOG(FATAL, "%s:%d: expected 4 fields", path, line_number);
+    }
+
+    const std::string context =
+        std::string{path} + ":" + std::to_string(line_number);
+    Rule& rule = rules.emplace_back();
+    if (const int result =
+            regcomp(&rule.name, std::string{fields[0]}.c_str(),
+                    REG_EXTENDED | REG_NOSUB)) {
+      char error[256];
+      regerror(result, &rule.name, error, sizeof(error));
+      LOG(FATAL, "%s: %s", context.c_str(), error);
+    }
+    rule.setting = parse_sched_setting(fields + 1, 3, system, context.c_str());
+  }
+
+  return rules;
+}
+
+// Sets this thread's scheduling to setting, which threads it creates inherit.
+// Failures are fatal.
+void set_self_sched(const SchedSetting& setting) {
+  if (setting.policy != -1 || setting.priority != -1) {
+    const int policy =
+        setting.policy != -1 ? setting.policy : sched_getscheduler(0);
+    sched_param param{};
+    if (setting.priority != -1) {
+      param.sched_priority = setting.priority;
+    } else if (policy == SCHED_FIFO || policy == SCHED_RR) {
+      PCHECK(sched_getparam(0, &param));
+    }
+    if (sched_setscheduler(0, policy, &param) != 0) {
+      LOG(FATAL, "--self-sched: sched_setscheduler(0, %s, %d): %s",
+          policy_string(policy), param.sched_priority, std::strerror(errno));
+    }
+  }
+  if (!setting.cpu_mask.empty()) {
+    const size_t size = setting.cpu_mask.size() * sizeof(unsigned long);
+    if (sched_setaffinity(
+            0, size,
+            reinterpret_cast<const cpu_set_t*>(setting.cpu_mask.data())) !=
+        0) {
+      LOG(FATAL, "--self-sched: sched_setaffinity(0): %s",
+          std::strerror(errno));
+    }
+  }
+}
+
+// Applies the first rule that matches each task, then writes a "before" and
+// "after" row for each task it actually changed. Returns false if any of the
+// changes couldn't be made.
+bool apply_rules(const Options& options, const System& system,
+                 const std::vector<Rule>& rules, CsvWriter* writer) {
+  // The changes may move tasks out of the scheduling filters, but they're
+  // still reported afterwards.
+  Options after_options = options;
+  after_options.policies = ~uint32_t{0};
+  after_options.min_priority = 0;
+  after_options.cpu = -1;
+
+  std::vector<Collector> collectors;
+  Collector after_collector;
+  TaskRecord after;
+  bool succeeded = true;
+  collect_tasks(
+      options, system, find_tids(options, system), &collectors,
+      [&](const TaskRecord& task) {
+        const auto rule = std::find_if(
+            rules.begin(), rules.end(), [&](const Rule& rule) {
+              return regexec(&rule.name, task.name.data(), 0, nullptr, 0) == 0;
+            });
+        if (rule == rules.end()) {
+          return;
+        }
+
+        // Only FIFO and RR have priorities, so leaving the priority as it is
+        // means 0 when a rule moves a task to another policy.
+        const SchedSetting& setting = rule->setting;
+        const int policy = setting.policy != -1 ? setting.policy : task.policy;
+        const bool real_time = policy == SCHED_FIFO || policy == SCHED_RR;
+        int priority = setting.priority;
+        if (priority == -1) {
+          priority = real_time ? task.priority : 0;
+        }
+        bool set_sched = policy != task.policy || priority != task.priority;
+        const bool set_cpu_mask =
+            !setting.cpu_mask.empty() && setting.cpu_mask != task.cpu_mask;
+
+        // Failures are reported and skipped rather than fatal so one task
+        // that can't be changed doesn't stop the rest. A "- N" rule can only
+        // be checked here, against the task's policy.
+        if (set_sched && !real_time && priority > 0) {
+          LOG(WARNING,
+              "%d (%.*s): %s only has priority 0, so priority %d isn't set",
+              task.tid, static_cast<int>(task.name.size()), task.name.data(),
+              policy_string(policy), priority);
+          succeeded = false;
+          set_sched = false;
+        }
+        if (!set_sched && !set_cpu_mask) {
+          return;
+        }
+
+        // Whether anything was actually changed, so there's an after row to
+        // show.
+        bool changed = false;
+        if (set_sched) {
+          sched_param param{};
+          param.sched_priority = priority;
+          if (sched_setscheduler(task.tid, policy, &param) == 0) {
+            changed = true;
+          } else if (errno != ESRCH) {
+            LOG(WARNING, "sched_setscheduler(%d, %s, %d): %s", task.tid,
+                policy_string(policy), priority, std::strerror(errno));
+            succeeded = false;
+          }
+        }
+        if (set_cpu_mask) {
+          const size_t size = setting.cpu_mask.size() * sizeof(unsigned long);
+          if (sched_setaffinity(task.tid, size,
+                                reinterpret_cast<const cpu_set_t*>(
+                                    setting.cpu_mask.data())) == 0) {
+            changed = true;
+          } else if (errno != ESRCH) {
+            LOG(WARNING, "sched_setaffinity(%d): %s", task.tid,
+                std::strerror(errno));
+            succeeded = false;
+          }
+        }
+        if (!changed) {
+          return;
+        }
+
+        after_collector.clear();
+        if (collect_task(after_options, system, {task.tid, task.pid},
+                         &after_collector, &after)) {
+          writer->write_event("before", task);
+          writer->write_event("after", after);
+        }
+      });
+  writer->flush();
+  return succeeded;
+}
+
+void usage(const char* argv0) {
+  std::printf(
+      "Usage: %s [--scan-pid-max] [--syscalls] [--sched-attr] [--paranoid]\n"
+      "          [--cgroup] [--irq] [--schedstat] [--columns LIST] [--jobs "
+      "N]\n"
+      "          [--watch INTERVAL [--rates]] [--bench N] [--cpumask "
+      "list|hex]\n"
+      "          [--format csv|binary|tree] [--summary [--top N]]\n"
+      "          [--policy LIST] [--min-priority N] [--pid LIST] [--name "
+      "REGEX]\n"
+      "          [--cpu N]\n"
+      "          [--daemon NAME [--shm-size KIB]] [--stream URL] "
+      "[--interval SECONDS]\n"
+      "          [--events]\n"
+      "          [--apply RULES] [--self-sched \"POLICY [PRIORITY [CPUS]]\"] "
+      "[--scan-stats]\n"
+      "          [--yield N]\n"
+      "\n"
+      "  --scan-pid-max  probe every PID up to pid_max instead of listing "
+      "/proc\n"
+      "  --syscalls      get policy, priority, and nice from syscalls instead "
+      "of\n"
+      "                  /proc/<pid>/stat\n"
+      "  --sched-attr    add sched_flags, the SCHED_DEADLINE runtime, "
+      "deadline, and\n"
+      "                  period in nanoseconds, and the util_min and util_max "
+      "clamps\n"
+      "                  from sched_getattr()\n"
+      "  --cgroup        add each process's cgroup in the cpuset hierarchy, "
+      "its\n"
+      "                  effective cpuset, and the CPUs in cpumask that are "
+      "isolated\n"
+      "                  with isolcpus= or nohz_full=\n"
+      "  --irq           add the IRQ each irq/<irq>-<name> thread handles and "
+      "the CPUs\n"
+      "                  in its smp_affinity_list\n"
+      "  --schedstat     add the nanoseconds each task ran and waited on a run "
+      "queue and\n"
+      "                  its number of timeslices, from /proc/<pid>/schedstat, "
+      "and with\n"
+      "                  --watch --rates, those since the last scan and the "
+      "longest wait\n"
+      "                  between any two scans in microseconds\n"
+      "  --columns LIST  write only the CSV columns in LIST, like "
+      "tid,policy,priority,\n"
+      "                  and only read what they need\n"
+      "  --paranoid      cross-check stat against /proc/<pid>/status\n"
+      "  -j, --jobs N    collect tasks with N threads (default 1)\n"
+      "  --bench N       time N scans and print the cost of each phase "
+      "instead\n"
+      "  -w, --watch INTERVAL\n"
+      "                  rescan every INTERVAL seconds and only print tasks "
+      "that\n"
+      "                  appeared, exited, or changed policy, priority, nice, "
+      "or\n"
+      "                  cpumask, prefixed with an event column\n"
+      "  --rates         with --watch, add the CPU time and context switches "
+      "each\n"
+      "                  task used since the last scan, and print tasks that "
+      "used\n"
+      "                  any\n"
+      "  --cpumask list|hex\n"
+      "                  print cpumask as a CPU list like 0-3,6 (default) or "
+      "a\n"
+      "                  hex bitmap like 4f\n"
+      "  --format csv|binary|tree\n"
+      "                  write CSV (default), the binary layout in "
+      "snapshot_format.h,\n"
+      "                  or each process followed by its threads\n"
+      "  --summary       instead of a row per task, print how many tasks have "
+      "each\n"
+      "                  policy, each priority, and each CPU in their "
+      "cpumask, then the\n"
+      "                  --top N (default 10, at most 10000) highest-priority "
+      "tasks\n"
+      "  --daemon NAME   instead of printing, publish a binary snapshot in the "
+      "shared\n"
+      "                  memory object NAME (like /dump_rtprio) every "
+      "--interval\n"
+      "                  SECONDS (default 1), in a region of --shm-size KIB "
+      "(default\n"
+      "                  4096)\n"
+      "  --stream URL    instead of printing, send what changed since the last "
+      "frame to\n"
+      "                  the collector at udp://HOST:PORT or tcp://HOST:PORT "
+      "every\n"
+      "                  --interval SECONDS (default 1), in the frames "
+      "described in\n"
+      "                  snapshot_format.h. HOST is an IPv4 address or an "
+      "IPv6 one in\n"
+      "                  brackets, like [fd00::1]\n"
+      "  --events        with --watch, --daemon, or --stream, also update "
+      "tasks as soon\n"
+      "                  as the kernel's proc connector reports they forked, "
+      "exec()ed,\n"
+      "                  exited, or were renamed, leaving the interval as a "
+      "full rescan\n"
+      "                  to catch scheduling changes (needs CAP_NET_ADMIN)\n"
+      "  --apply RULES   set the policy, priority, and cpumask of tasks by the "
+      "first\n"
+      "                  line of RULES whose name regex matches, like\n"
+      "                  \"^irq/.*-can FIFO 50 1\" (- leaves a field as it "
+      "is), and\n"
+      "                  print each changed task's row before and after\n"
+      "  --self-sched \"POLICY [PRIORITY [CPUS]]\"\n"
+      "                  set this process's own policy, priority, and cpumask "
+      "before\n"
+      "                  scanning, like \"IDLE - 0\" (- leaves a field as "
+      "it is)\n"
+      "  --scan-stats    print each scan's duration, CPU time, and "
+      "involuntary context\n"
+      "                  switches to stderr\n"
+      "  --yield N       with --watch, --daemon, or --stream, sched_yield() "
+      "after each\n"
+      "                  batch of N tasks to let waiting tasks run\n"
+      "\n"
+      "Only tasks matching all of these are printed:\n"
+      "  --policy LIST   policies in LIST, like FIFO,RR\n"
+      "  --min-priority N\n"
+      "                  priority of at least N\n"
+      "  --pid LIST      belonging to the processes in LIST\n"
+      "  --name REGEX    name matching the extended regular expression "
+      "REGEX\n"
+      "  --cpu N         cpumask including CPU N\n",
+      argv0);
+}
+
+// Parses the command line and does what it says. Returns the exit status.
+int run(int argc, char** argv) {
+  Options options;
+
+  static const option long_options[] = {
+      {"scan-pid-max", no_argument, nullptr, 'p'},
+      {"syscalls", no_argument, nullptr, 's'},
+      {"paranoid", no_argument, nullptr, 'V'},
+      {"jobs", required_argument, nullptr, 'j'},
+      {"watch", required_argument, nullptr, 'w'},
+      {"rates", no_argument, nullptr, 'r'},
+      {"sched-attr", no_argument, nullptr, 'a'},
+      {"daemon", required_argument, nullptr, 'D'},
+      {"events", no_argument, nullptr, 'e'},
+      {"apply", required_argument, nullptr, 'A'},
+      {"cgroup", no_argument, nullptr, 'G'},
+      {"irq", no_argument, nullptr, 'Q'},
+      {"schedstat", no_argument, nullptr, 'H'},
+      {"columns", required_argument, nullptr, 'L'},
+      {"self-sched", required_argument, nullptr, 'Z'},
+      {"scan-stats", no_argument, nullptr, 'T'},
+      {"yield", required_argument, nullptr, 'Y'},
+      {"interval", required_argument, nullptr, 'I'},
+      {"shm-size", required_argument, nullptr, 'S'},
+      {"stream", required_argument, nullptr, 'U'},
+      {"bench", required_argument, nullptr, 'b'},
+      {"cpumask", required_argument, nullptr, 'c'},
+      {"format", required_argument, nullptr, 'f'},
+      {"summary", no_argument, nullptr, 'M'},
+      {"top", required_argument, nullptr, 'O'},
+      {"policy", required_argument, nullptr, 'P'},
+      {"min-priority", required_argument, nullptr, 'm'},
+      {"pid", required_argument, nullptr, 'i'},
+      {"name", required_argument, nullptr, 'n'},
+      {"cpu", required_argument, nullptr, 'C'},
+      {"help", no_argument, nullptr, 'h'},
+      {nullptr, 0, nullptr, 0}};
+  while (true) {
+    const int opt = getopt_long(argc, argv, "hj:w:", long_options, nullptr);
+    if (opt == -1) {
+      break;
+    }
+    switch (opt) {
+      case 'p':
+        options.scan_pid_max = true;
+        break;
+      case 's':
+        options.use_syscalls = true;
+        break;
+      case 'V':
+        options.paranoid = true;
+        break;
+      case 'j':
+        options.jobs = parse_int_option("jobs", optarg);
+        if (options.jobs < 1) {
+          LOG(FATAL, "--jobs must be at least 1");
+        }
+        break;
+      case 'w':
+        options.watch = true;
+        options.watch_interval = parse_seconds_option("watch", optarg);
+        break;
+      case 'r':
+        options.rates = true;
+        break;
+      case 'a':
+        options.sched_attr = true;
+        break;
+      case 'D':
+        options.daemon_name = optarg;
+        break;
+      case 'e':
+        options.events = true;
+        break;
+      case 'A':
+        options.apply_path = optarg;
+        break;
+      case 'G':
+        options.cgroup = true;
+        break;
+      case 'Q':
+        options.irq = true;
+        break;
+      case 'H':
+        options.schedstat = true;
+        break;
+      case 'L':
+        options.columns.clear();
+        for_each_list_item(optarg, [&](std::string_view name) {
+          const auto it = std::find_if(
+              std::begin(kColumns), std::end(kColumns),
+              [&](const ColumnInfo& column) { return name == column.name; });
+          if (it == std::end(kColumns)) {
+            LOG(FATAL, "--columns: unknown column \"%.*s\"",
+                static_cast<int>(name.size()), name.data());
+          }
+          options.columns.push_back(
+              static_cast<ColumnId>(it - std::begin(kColumns)));
+        });
+        if (options.columns.empty()) {
+          LOG(FATAL, "--columns needs at least one column");
+        }
+        break;
+      case 'Z':
+        options.self_sched = optarg;
+        break;
+      case 'T':
+        options.scan_stats = true;
+        break;
+      case 'Y':
+        options.yield_every = parse_int_option("yield", optarg);
+        if (options.yield_every < 1) {
+          LOG(FATAL, "--yield must be at least 1");
+        }
+        break;
+      case 'I':
+        options.publish_interval = parse_seconds_option("interval", optarg);
+        break;
+      case 'S': {
+        const int kib = parse_int_option("shm-size", optarg);
+        if (kib < 1) {
+          LOG(FATAL, "--shm-size must be at least 1");
+        }
+        options.daemon_capacity = size_t{1024} * kib;
+        break;
+      }
+      case 'U':
+        options.stream_url = optarg;
+        break;
+      case 'b':
+        options.bench = parse_int_option("bench", optarg);
+        if (options.bench < 1) {
+          LOG(FATAL, "--bench must be at least 1");
+        }
+        break;
+      case 'c':
+        if (optarg == std::string_view{"list"}) {
+          options.cpu_mask_format = CpuMaskFormatter::kList;
+        } else if (optarg == std::string_view{"hex"}) {
+          options.cpu_mask_format = CpuMaskFormatter::kHex;
+        } else {
+          LOG(FATAL, "--cpumask: expected list or hex, got \"%s\"", optarg);
+        }
+        break;
+      case 'f':
+        if (optarg == std::string_view{"csv"}) {
+          options.format = Options::kCsv;
+        } else if (optarg == std::string_view{"binary"}) {
+          options.format = Options::kBinary;
+        } else if (optarg == std::string_view{"tree"}) {
+          options.format = Options::kTree;
+        } else {
+          LOG(FATAL, "--format: expected csv, binary, or tree, got \"%s\"",
+              optarg);
+        }
+        break;
+      case 'M':
+        options.summary = true;
+        break;
+      case 'O':
+        options.top = parse_int_option("top", optarg);
+        if (options.top < 0 || options.top > SummaryWriter::kMaxTop) {
+          LOG(FATAL, "--top must be from 0 to %d", SummaryWriter::kMaxTop);
+        }
+        break;
+      case 'P':
+        options.policies = 0;
+        for_each_list_item(optarg, [&](std::string_view name) {
+          const int policy = parse_policy(name);
+          if (policy == -1) {
+            LOG(FATAL, "--policy: unknown policy \"%.*s\"",
+                static_cast<int>(name.size()), name.data());
+          }
+          options.policies |= uint32_t{1} << policy;
+        });
+        break;
+      case 'm':
+        options.min_priority = parse_int_option("min-priority", optarg);
+        break;
+      case 'i':
+        for_each_list_item(optarg, [&](std::string_view pid) {
+          options.pids.push_back(
+              parse_int_option("pid", std::string{pid}.c_str()));
+        });
+        break;
+      case 'n':
+        if (const int result = regcomp(&options.name_regex, optarg,
+                                       REG_EXTENDED | REG_NOSUB)) {
+          char error[256];
+          regerror(result, &options.name_regex, error, sizeof(error));
+          LOG(FATAL, "--name: %s", error);
+        }
+        options.has_name_regex = true;
+        break;
+      case 'C':
+        options.cpu = parse_int_option("cpu", optarg);
+        if (options.cpu < 0) {
+          LOG(FATAL, "--cpu must be at least 0");
+        }
+        break;
+      case 'h':
+        usage(argv[0]);
+        return 0;
+      default:
+        usage(argv[0]);
+        return 1;
+    }
+  }
+
+  if (options.watch && options.format != Options::kCsv) {
+    LOG(FATAL, "--watch only supports --format csv");
+  }
+
+  if (options.daemon_name != nullptr &&
+      (options.watch || options.format != Options::kCsv)) {
+    LOG(FATAL, "--daemon can't be used with --watch or --format");
+  }
+  if (options.stream_url != nullptr &&
+      (options.watch || options.daemon_name != nullptr ||
+       options.format != Options::kCsv)) {
+    LOG(FATAL, "--stream can't be used with --watch, --daemon, or --format");
+  }
+  const bool publishing =
+      options.daemon_name != nullptr || options.stream_url != nullptr;
+  if (publishing &&
+      (options.sched_attr || options.cgroup || options.irq ||
+       options.schedstat || !options.columns.empty())) {
+    LOG(FATAL,
+        "--daemon and --stream only publish the binary snapshot's fields, so "
+        "they can't be used with --sched-attr, --cgroup, --irq, --schedstat, "
+        "or --columns");
+  }
+  if (options.apply_path != nullptr &&
+      (options.watch || publishing || options.bench > 0 ||
+       options.format != Options::kCsv)) {
+    LOG(FATAL,
+        "--apply can't be used with --watch, --daemon, --stream, --bench, or "
+        "--format");
+  }
+  if (options.events && !options.watch && !publishing) {
+    LOG(FATAL, "--events needs --watch, --daemon, or --stream");
+  }
+  if (options.yield_every > 0 && !options.watch && !publishing) {
+    LOG(FATAL, "--yield needs --watch, --daemon, or --stream");
+  }
+  if (options.scan_stats &&
+      (options.bench > 0 || options.apply_path != nullptr)) {
+    LOG(FATAL, "--scan-stats can't be used with --bench or --apply");
+  }
+  if (options.sched_attr && options.format != Options::kCsv) {
+    LOG(FATAL, "--sched-attr only supports --format csv");
+  }
+  if (options.cgroup && options.format != Options::kCsv) {
+    LOG(FATAL, "--cgroup only supports --format csv");
+  }
+  if (options.irq && options.format != Options::kCsv) {
+    LOG(FATAL, "--irq only supports --format csv");
+  }
+  if (options.schedstat && options.format != Options::kCsv) {
+    LOG(FATAL, "--schedstat only supports --format csv");
+  }
+  if (!options.columns.empty() &&
+      (options.sched_attr || options.cgroup || options.irq ||
+       options.schedstat || options.format != Options::kCsv)) {
+    LOG(FATAL,
+        "--columns can't be used with --sched-attr, --cgroup, --irq, "
+        "--schedstat, or --format");
+  }
+  if (options.summary &&
+      (options.watch || publishing || options.apply_path != nullptr ||
+       options.format != Options::kCsv || options.sched_attr ||
+       options.cgroup || options.irq || options.schedstat ||
+       !options.columns.empty())) {
+    LOG(FATAL,
+        "--summary can't be used with --watch, --daemon, --stream, --apply, "
+        "--format, --sched-attr, --cgroup, --irq, --schedstat, or "
+        "--columns");
+  }
+  if (options.top != -1 && !options.summary) {
+    LOG(FATAL, "--top needs --summary");
+  }
+  if (options.summary) {
+    // Only what's counted or printed in the top table is collected.
+    options.columns = {kNameColumn, kCpuMaskColumn, kPolicyColumn,
+                       kNiceColumn, kPriorityColumn, kTidColumn,
+                       kPidColumn};
+    if (options.top == -1) {
+      options.top = 10;
+    }
+  }
+  if (options.columns.empty()) {
+    options.columns =
+        default_columns(options.sched_attr, options.cgroup, options.irq,
+                        options.schedstat);
+  }
+  // Exit events remove tasks when they become zombies, so rescans have to
+  // agree or the zombies would come back as new.
+  options.skip_zombies = options.events;
+  options.find_sources();
+  options.stats = options.bench > 0;
+
+  const System system = find_system();
+  if (options.needs_sched_attr() && !system.has_sched_getattr) {
+    LOG(FATAL, "--sched-attr needs sched_getattr(), which isn't available");
+  }
+  if (options.needs_schedstat() && !system.has_schedstat) {
+    LOG(FATAL,
+        "the schedstat columns need /proc/<pid>/schedstat, which the kernel "
+        "only has with CONFIG_SCHED_INFO");
+  }
+
+  // This is done before anything that's measured or that starts threads,
+  // which inherit it.
+  if (options.self_sched != nullptr) {
+    std::string_view fields[3];
+    const size_t field_count = split_fields(options.self_sched, fields, 3);
+    if (field_count == 0 || field_count > 3) {
+      LOG(FATAL, "--self-sched: expected a policy, priority, and CPU list");
+    }
+    set_self_sched(
+        parse_sched_setting(fields, field_count, system, "--self-sched"));
+  }
+
+  if (options.bench > 0) {
+    bench(options, system);
+    return 0;
+  }
+
+  if (options.daemon_name != nullptr) {
+    SharedMemoryWriter writer{options.daemon_name, options.daemon_capacity,
+                              system};
+    publish(options, system, &writer);
+  }
+  if (options.stream_url != nullptr) {
+    StreamWriter writer{options.stream_url, options.publish_interval, system};
+    publish(options, system, &writer);
+  }
+
+  if (options.apply_path != nullptr) {
+    const std::vector<Rule> rules = read_rules(options.apply_path, system);
+    CsvWriter writer{STDOUT_FILENO, options, system};
+    writer.write_header(true);
+    return apply_rules(options, system, rules, &writer) ? 0 : 1;
+  }
+
+  if (options.watch) {
+    CsvWriter writer{STDOUT_FILENO, options, system};
+    writer.write_header(true, options.rates);
+    watch(options, system, &writer);
+  }
+
+  std::unique_ptr<OutputBackend> backend =
+      make_backend(options, system, STDOUT_FILENO);
+
+  std::vector<Collector> collectors;
+  const ScanReport report;
+  size_t tasks = 0;
+  backend->begin();
+  collect_tasks(options, system, find_tids(options, system), &collectors,
+                [&](const TaskRecord& task) {
+                  ++tasks;
+                  backend->write_task(task);
+                });
+  backend->end();
+  if (options.scan_stats) {
+    report.print(tasks);
+  }
+  return 0;
+}
+
+}  // namespace
+}  // namespace dump_rtprio
+
+int main(int argc, char** argv) { return dump_rtprio::run(argc, argv); }
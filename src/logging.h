@@ -0,0 +1,62 @@
+// Copyright (c) Tyler Veness.
+
+#pragma once
+
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <stdexcept>
+#include <string_view>
+
+namespace dump_rtprio {
+
+template <typename T>
+void CHECK_EQ(T val1, T val2) {
+  if (val1 != val2) {
+    throw std::runtime_error("CHECK_EQ() failed");
+  }
+}
+
+template <typename T>
+void PCHECK(T val) {
+  if (val != 0) {
+    throw std::runtime_error("PCHECK() failed");
+  }
+}
+
+enum LogLevel { FATAL, WARNING };
+
+// Messages are formatted into a buffer and written with a single write() so
+// lines from different threads don't interleave, and without iostreams, whose
+// static initialization is much of the startup time on the roboRIO. Messages
+// longer than the buffer are truncated.
+template <typename T, typename... Ts>
+void LOG(LogLevel level, T val, Ts&&... vals) {
+  char buffer[1024];
+  const std::string_view prefix = level == FATAL ? "FATAL: " : "WARNING: ";
+  char* end = std::copy(prefix.begin(), prefix.end(), buffer);
+
+  const size_t available = buffer + sizeof(buffer) - end;
+  const int size = std::snprintf(end, available, val, vals...);
+  if (size > 0) {
+    end += std::min(static_cast<size_t>(size), available - 1);
+  }
+  *end++ = '\n';
+
+  // There's nowhere to report it if stderr can't be written to.
+  [[maybe_unused]] const ssize_t written =
+      write(STDERR_FILENO, buffer, end - buffer);
+
+  if (level == FATAL) {
+    std::exit(1);
+  }
+}
+
+template <typename T, typename... Ts>
+void PLOG(LogLevel level, T val, Ts&&... vals) {
+  LOG(level, val, vals...);
+}
+
+}  // namespace dump_rtprio
@@ -0,0 +1,266 @@
+// Copyright (c) Tyler Veness.
+
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+
+#include <atomic>
+
+// Layout of the snapshots dump_rtprio writes with --format binary.
+//
+// A snapshot is a SnapshotHeader, then header.record_count SnapshotRecords in
+// TID order, then header.cpu_mask_count CPU masks of header.cpu_mask_words
+// uint64_t each, then header.strings_size bytes of NUL-terminated strings.
+// Each section starts at the offset given in the header, which is always a
+// multiple of 8, so a reader can mmap() a snapshot and use the structs in
+// place after checking magic, version, and byte_order.
+//
+// Integers are in the byte order of the host that wrote the snapshot.
+//
+// dump_rtprio --daemon publishes snapshots in a POSIX shared memory object laid
+// out as a SnapshotRegion followed by the current snapshot. Readers
+// shm_open() and mmap() it read-only and then use copy_snapshot(), which makes
+// no syscalls.
+//
+// dump_rtprio --stream sends the same records to a collector as frames, each
+// a StreamFrameHeader followed by header.entries_size bytes of entries, over
+// UDP one frame per datagram or over TCP back to back. Each scan only sends
+// the tasks that changed since the previous one, so see StreamField for how
+// a receiver keeps its own copy of the table up to date. Over TCP a scan is
+// one frame. Over UDP it's split into as many frames as it takes to keep each
+// within kStreamMaxDatagram bytes.
+
+namespace dump_rtprio {
+
+inline constexpr char kSnapshotMagic[8] = {'R', 'T', 'P', 'R',
+                                           'I', 'O', 'S', 'N'};
+
+// Incremented whenever the layout changes incompatibly.
+inline constexpr uint32_t kSnapshotVersion = 1;
+
+// Written as a native uint32_t so readers can detect the byte order.
+inline constexpr uint32_t kSnapshotByteOrder = 0x01020304;
+
+struct SnapshotHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t byte_order;
+
+  // sizeof(SnapshotHeader) and sizeof(SnapshotRecord) as written, so readers
+  // can skip fields added to the end of either in compatible versions.
+  uint32_t header_size;
+  uint32_t record_size;
+
+  // Seconds since the epoch the system booted at (btime in /proc/stat).
+  uint64_t boot_time;
+
+  // CLOCK_REALTIME nanoseconds when the scan started.
+  uint64_t capture_time;
+
+  uint32_t pid_max;
+  uint32_t nproc;
+
+  uint32_t record_count;
+  uint32_t cpu_mask_count;
+  uint32_t cpu_mask_words;
+  uint32_t reserved;
+
+  uint64_t records_offset;
+  uint64_t cpu_masks_offset;
+  uint64_t strings_offset;
+  uint64_t strings_size;
+};
+
+struct SnapshotRecord {
+  // Offsets of NUL-terminated strings in the string table.
+  uint32_t exe;
+  uint32_t name;
+
+  // Index of the task's affinity in the CPU mask table. Bit N of word N / 64
+  // is set if the task may run on CPU N.
+  uint32_t cpu_mask;
+
+  // The rest are the CSV columns of the same names. policy is the SCHED_*
+  // constant.
+  int32_t policy;
+  int32_t nice;
+  int32_t priority;
+  int32_t tid;
+  int32_t pid;
+  int32_t ppid;
+  int32_t sid;
+  int32_t cpu;
+  uint32_t reserved;
+
+  // Clock ticks after boot the task started at.
+  uint64_t starttime;
+};
+
+static_assert(sizeof(SnapshotHeader) == 96);
+static_assert(sizeof(SnapshotRecord) == 56);
+
+inline constexpr char kSnapshotRegionMagic[8] = {'R', 'T', 'P', 'R',
+                                                 'I', 'O', 'S', 'M'};
+
+// Incremented whenever the layout of SnapshotRegion changes incompatibly.
+inline constexpr uint32_t kSnapshotRegionVersion = 1;
+
+struct SnapshotRegion {
+  // All zero until the daemon has initialized the rest.
+  char magic[8];
+  uint32_t version;
+
+  // A seqlock: odd while the daemon is replacing the snapshot, and even and
+  // incremented by two each time it has replaced it.
+  std::atomic<uint32_t> sequence;
+
+  // How many bytes of snapshot follow this struct, and how many of them the
+  // current snapshot uses.
+  uint64_t capacity;
+  uint64_t size;
+
+  uint64_t reserved;
+
+  char* snapshot() { return reinterpret_cast<char*>(this + 1); }
+  const char* snapshot() const {
+    return reinterpret_cast<const char*>(this + 1);
+  }
+};
+
+static_assert(sizeof(SnapshotRegion) == 40);
+static_assert(std::atomic<uint32_t>::is_always_lock_free,
+              "The sequence is shared between processes");
+
+inline constexpr char kStreamMagic[8] = {'R', 'T', 'P', 'R',
+                                         'I', 'O', 'S', 'F'};
+
+// Incremented whenever the frame layout changes incompatibly.
+inline constexpr uint32_t kStreamVersion = 1;
+
+// Set in StreamFrameHeader::flags on the first frame of a scan when the
+// receiver should clear its table before applying it. The first scan is a
+// keyframe, as is every kStreamKeyframeInterval-th after it and the first
+// after a frame couldn't be sent, so a UDP receiver that sees a gap in
+// sequence can drop frames until the next one.
+inline constexpr uint32_t kStreamKeyframe = 1 << 0;
+inline constexpr uint32_t kStreamKeyframeInterval = 60;
+
+// Set on the last frame of a scan, after which the receiver's table matches
+// the sender's.
+inline constexpr uint32_t kStreamScanEnd = 1 << 1;
+
+// UDP frames are split before any entry that would make them bigger than
+// this, which fits in an Ethernet MTU with room for tunnel headers. A frame
+// is only bigger if its one entry is. A keyframe of a big system is a burst
+// of frames, so receivers should raise SO_RCVBUF enough to hold one.
+inline constexpr uint32_t kStreamMaxDatagram = 1400;
+
+struct StreamFrameHeader {
+  char magic[8];
+  uint32_t version;
+
+  // kSnapshotByteOrder in the sender's byte order, which the rest of the
+  // header is in. Entries are the same on every host.
+  uint32_t byte_order;
+
+  // sizeof(StreamFrameHeader) as written.
+  uint32_t header_size;
+
+  uint32_t flags;
+  uint32_t entry_count;
+  uint32_t entries_size;
+
+  // Counts frames from 0 since the sender started.
+  uint64_t sequence;
+
+  // As in SnapshotHeader.
+  uint64_t capture_time;
+  uint64_t boot_time;
+};
+
+static_assert(sizeof(StreamFrameHeader) == 56);
+
+// Each entry is a varint TID, as the difference from the previous entry's TID
+// in the same frame (or from 0 for the first), then a varint mask of these
+// bits. Entries are in TID order. A mask of 0 means the task exited. Otherwise
+// the fields whose bits are set follow in bit order and replace the
+// receiver's, and a task the receiver doesn't have has all of them.
+//
+// Varints are unsigned LEB128: 7 bits per byte, least significant first, with
+// the high bit set on all but the last byte. nice is zigzag encoded, so -1 is
+// 1, 1 is 2, and so on. Strings are a varint length followed by that many
+// bytes. cpu_mask is a varint number of words followed by each word as a
+// varint, with the same bits as a SnapshotHeader CPU mask. The rest are the
+// SnapshotRecord fields of the same names.
+enum StreamField : uint32_t {
+  kStreamExe = 1 << 0,
+  kStreamName = 1 << 1,
+  kStreamCpuMask = 1 << 2,
+  kStreamPolicy = 1 << 3,
+  kStreamNice = 1 << 4,
+  kStreamPriority = 1 << 5,
+  kStreamPid = 1 << 6,
+  kStreamPpid = 1 << 7,
+  kStreamSid = 1 << 8,
+  kStreamCpu = 1 << 9,
+  kStreamStarttime = 1 << 10,
+  kStreamAllFields = (1 << 11) - 1,
+};
+
+// Reads a varint from [*pos, end) and advances *pos past it. Returns false if
+// it runs past end or doesn't fit in 64 bits.
+inline bool read_stream_varint(const uint8_t** pos, const uint8_t* end,
+                               uint64_t* value) {
+  *value = 0;
+  for (int shift = 0; shift < 64 && *pos < end; shift += 7) {
+    const uint8_t byte = *(*pos)++;
+    *value |= uint64_t{byte & 0x7fu} << shift;
+    if ((byte & 0x80) == 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// How many times copy_snapshot() reads the sequence before giving up. That
+// spins for several milliseconds even on a fast CPU, longer than the daemon
+// takes to copy in the largest snapshot a region holds.
+inline constexpr int kCopySnapshotAttempts = 1 << 24;
+
+// Copies the current snapshot from region into buffer, retrying while the
+// daemon is replacing it. Returns the snapshot's size, or 0 if region hasn't
+// been initialized, the snapshot is bigger than buffer_size, or it was still
+// being replaced after kCopySnapshotAttempts tries (e.g. because the daemon
+// died partway through), in which case callers should back off and try again
+// later. *sequence is set to the snapshot's sequence number. A reader polling
+// for new snapshots can compare region.sequence against it first and skip
+// calling this when it hasn't changed.
+inline size_t copy_snapshot(const SnapshotRegion& region, void* buffer,
+                            size_t buffer_size, uint32_t* sequence) {
+  for (int attempt = 0; attempt < kCopySnapshotAttempts; ++attempt) {
+    const uint32_t before = region.sequence.load(std::memory_order_acquire);
+    if (before % 2 != 0) {
+      continue;
+    }
+    if (memcmp(region.magic, kSnapshotRegionMagic, sizeof(region.magic)) !=
+        0) {
+      return 0;
+    }
+
+    // size may be torn if the daemon started another write, so it's bounded
+    // before use and only trusted if the sequence didn't change.
+    const uint64_t size = region.size;
+    if (size <= buffer_size && size <= region.capacity) {
+      memcpy(buffer, region.snapshot(), size);
+    }
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (region.sequence.load(std::memory_order_relaxed) == before) {
+      *sequence = before;
+      return size <= buffer_size ? size : 0;
+    }
+  }
+  return 0;
+}
+
+}  // namespace dump_rtprio
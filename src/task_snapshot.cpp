@@ -0,0 +1,1166 @@
+// Copyright (c) Tyler Veness.
+
+#include "task_snapshot.h"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <stdint.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <charconv>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace dump_rtprio {
+
+thread_local ScanStats* current_stats = nullptr;
+
+namespace {
+
+std::string_view strip(std::string_view str) {
+  // Left strip
+  while (!str.empty() &&
+         (str.front() == ' ' || str.front() == '\t' || str.front() == '\n')) {
+    str.remove_prefix(1);
+  }
+
+  // Right strip
+  while (!str.empty() &&
+         (str.back() == ' ' || str.back() == '\t' || str.back() == '\n')) {
+    str.remove_suffix(1);
+  }
+
+  return str;
+}
+
+int find_pid_max() {
+  std::FILE* pid_max_file = std::fopen("/proc/sys/kernel/pid_max", "r");
+  if (pid_max_file == nullptr) {
+    PLOG(FATAL, "fopen(\"/proc/sys/kernel/pid_max\")");
+  }
+
+  int r;
+  CHECK_EQ(1, std::fscanf(pid_max_file, "%d", &r));
+
+  PCHECK(std::fclose(pid_max_file));
+
+  return r;
+}
+
+// Returns the PID named by a /proc directory entry, or -1 for entries that
+// aren't a PID (e.g. "self" or "meminfo").
+int parse_pid(const char* name) {
+  if (*name == '\0') {
+    return -1;
+  }
+
+  int r = 0;
+  for (; *name != '\0'; ++name) {
+    if (*name < '0' || *name > '9') {
+      return -1;
+    }
+    r = r * 10 + (*name - '0');
+  }
+
+  return r;
+}
+
+// Calls func with every PID-named entry in the directory open as fd. Returns
+// false if the directory went away while it was being read (e.g. the process
+// whose task directory it is exited).
+template <typename F>
+bool for_each_pid_entry(int fd, F&& func) {
+  // glibc only gained a getdents64() wrapper in 2.30, so the syscall is made
+  // directly. struct dirent64 has the same layout as the records it returns.
+  alignas(dirent64) char buffer[32768];
+  while (true) {
+    const long size = syscall(SYS_getdents64, fd, buffer, sizeof(buffer));
+    count_syscalls(1, size > 0 ? size : 0);
+    if (size == -1) {
+      if (errno == ENOENT || errno == ESRCH) {
+        return false;
+      }
+      PLOG(FATAL, "getdents64(%d, %p, %zu)", fd, buffer, sizeof(buffer));
+    }
+    if (size == 0) {
+      return true;
+    }
+
+    for (long offset = 0; offset < size;) {
+      const auto entry = reinterpret_cast<const dirent64*>(buffer + offset);
+      offset += entry->d_reclen;
+
+      const int pid = parse_pid(entry->d_name);
+      if (pid != -1) {
+        func(pid);
+      }
+    }
+  }
+}
+
+// Opens /proc for use as the dirfd of per-task openat() calls, which saves the
+// kernel from walking "/proc" again for every file read.
+int open_proc() {
+  const int proc_fd = open("/proc", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (proc_fd == -1) {
+    PLOG(FATAL, "open(\"/proc\")");
+  }
+  return proc_fd;
+}
+
+}  // namespace
+
+bool parse_cpu_list(std::string_view list, CpuMask* mask) {
+  std::fill(mask->begin(), mask->end(), 0);
+  const size_t cpus = mask->size() * kBitsPerWord;
+  bool valid = !list.empty();
+  for_each_list_item(list, [&](std::string_view item) {
+    const size_t dash = std::min(item.find('-'), item.size());
+    size_t first = 0;
+    size_t last = 0;
+    const auto [first_end, first_ec] =
+        std::from_chars(item.data(), item.data() + dash, first);
+    if (first_ec != std::errc{} || first_end != item.data() + dash) {
+      valid = false;
+      return;
+    }
+    last = first;
+    if (dash != item.size()) {
+      const auto [last_end, last_ec] = std::from_chars(
+          item.data() + dash + 1, item.data() + item.size(), last);
+      if (last_ec != std::errc{} || last_end != item.data() + item.size()) {
+        valid = false;
+        return;
+      }
+    }
+    if (last < first || last >= cpus) {
+      valid = false;
+      return;
+    }
+    for (size_t cpu = first; cpu <= last; ++cpu) {
+      (*mask)[cpu / kBitsPerWord] |= 1ul << (cpu % kBitsPerWord);
+    }
+  });
+  return valid;
+}
+
+namespace {
+
+// The kernel's struct sched_attr, which glibc only declares in recent versions.
+// This is SCHED_ATTR_SIZE_VER1, the first version with the util clamp fields.
+struct SchedAttr {
+  uint32_t size;
+  uint32_t sched_policy;
+  uint64_t sched_flags;
+  int32_t sched_nice;
+  uint32_t sched_priority;
+
+  // SCHED_DEADLINE parameters, in nanoseconds.
+  uint64_t sched_runtime;
+  uint64_t sched_deadline;
+  uint64_t sched_period;
+
+  // Utilization clamps, from 0 to 1024.
+  uint32_t sched_util_min;
+  uint32_t sched_util_max;
+};
+
+static_assert(sizeof(SchedAttr) == 56);
+
+// Calls sched_getattr(2), returning -1 with errno set on failure.
+int sched_getattr(int process, SchedAttr* attr) {
+#ifdef SYS_sched_getattr
+  // Kernels older than util clamp fill in less and set attr->size to match, so
+  // zero the rest.
+  *attr = SchedAttr();
+  return syscall(SYS_sched_getattr, process, attr, sizeof(*attr), 0);
+#else
+  (void)process;
+  (void)attr;
+  errno = ENOSYS;
+  return -1;
+#endif
+}
+
+uint64_t find_boot_time() {
+  std::FILE* stat_file = std::fopen("/proc/stat", "r");
+  if (stat_file == nullptr) {
+    PLOG(FATAL, "fopen(\"/proc/stat\")");
+  }
+
+  uint64_t r = 0;
+  char buffer[1024];
+  while (std::fgets(buffer, sizeof(buffer), stat_file) != nullptr) {
+    std::string_view line{buffer};
+    if (line.starts_with("btime ")) {
+      line.remove_prefix(sizeof("btime ") - 1);
+      line = strip(line);
+      std::from_chars(line.begin(), line.end(), r);
+      break;
+    }
+  }
+
+  PCHECK(std::fclose(stat_file));
+
+  return r;
+}
+
+// Adds the CPUs in a CPU list file like /sys/devices/system/cpu/isolated to
+// *mask. A file that doesn't exist has none.
+void add_cpu_list_file(const char* path, CpuMask* mask) {
+  const int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd == -1 && errno == ENOENT) {
+    return;
+  }
+  if (fd == -1) {
+    PLOG(FATAL, "open(\"%s\")", path);
+  }
+  char buffer[16384];
+  const ssize_t size = read(fd, buffer, sizeof(buffer));
+  if (size == -1) {
+    PLOG(FATAL, "read(\"%s\")", path);
+  }
+  PCHECK(close(fd));
+
+  // nohz_full is "(null)" when it isn't enabled.
+  const std::string_view list = strip({buffer, static_cast<size_t>(size)});
+  CpuMask cpus(mask->size());
+  if (!list.empty() && list != "(null)" && parse_cpu_list(list, &cpus)) {
+    for (size_t i = 0; i < mask->size(); ++i) {
+      (*mask)[i] |= cpus[i];
+    }
+  }
+}
+
+// Finds the hierarchy with the cpuset controller. With cgroup v1 (including
+// alongside v2 in hybrid setups) it has its own, and otherwise it's in the v2
+// one.
+void find_cpuset_hierarchy(System* system) {
+  constexpr int kFlags = O_RDONLY | O_DIRECTORY | O_CLOEXEC;
+  system->cpuset_fd = open("/sys/fs/cgroup/cpuset", kFlags);
+  if (system->cpuset_fd != -1) {
+    system->cpuset_v2 = false;
+    return;
+  }
+  if (access("/sys/fs/cgroup/cgroup.controllers", F_OK) == 0) {
+    system->cpuset_fd = open("/sys/fs/cgroup", kFlags);
+    system->cpuset_v2 = true;
+  }
+}
+
+int find_nproc() {
+  const long nproc = sysconf(_SC_NPROCESSORS_CONF);
+  if (nproc == -1) {
+    PLOG(FATAL, "sysconf(_SC_NPROCESSORS_CONF)");
+  }
+  return nproc;
+}
+
+// Returns the number of words in the smallest CpuMask sched_getaffinity()
+// accepts. That's normally enough for nproc CPUs, but the kernel rejects
+// masks smaller than its own, which can be bigger.
+size_t find_cpu_mask_words(int nproc) {
+  CpuMask mask(CPU_ALLOC_SIZE(nproc) / sizeof(unsigned long));
+  while (sched_getaffinity(0, mask.size() * sizeof(unsigned long),
+                           reinterpret_cast<cpu_set_t*>(mask.data())) != 0) {
+    if (errno != EINVAL || mask.size() >= 1024) {
+      PLOG(FATAL, "sched_getaffinity(0, %zu, %p)",
+           mask.size() * sizeof(unsigned long), mask.data());
+    }
+    mask.resize(mask.size() * 2);
+  }
+  return mask.size();
+}
+
+}  // namespace
+
+System find_system() {
+  System r;
+  r.proc_fd = open_proc();
+  r.nproc = find_nproc();
+  r.cpu_mask_words = find_cpu_mask_words(r.nproc);
+  r.pid_max = find_pid_max();
+  r.boot_time = find_boot_time();
+  r.clock_ticks_per_second = sysconf(_SC_CLK_TCK);
+  if (r.clock_ticks_per_second <= 0) {
+    PLOG(FATAL, "sysconf(_SC_CLK_TCK)");
+  }
+  // Seccomp filters may refuse unknown syscalls with EPERM instead of ENOSYS,
+  // so treat any failure on ourself as it not being there.
+  SchedAttr attr;
+  r.has_sched_getattr = sched_getattr(0, &attr) == 0;
+  r.has_schedstat = faccessat(r.proc_fd, "self/schedstat", R_OK, 0) == 0;
+  r.isolated_cpus.resize(r.cpu_mask_words);
+  add_cpu_list_file("/sys/devices/system/cpu/isolated", &r.isolated_cpus);
+  add_cpu_list_file("/sys/devices/system/cpu/nohz_full", &r.isolated_cpus);
+  find_cpuset_hierarchy(&r);
+  return r;
+}
+
+namespace {
+
+// Fills in *mask, which must already be system.cpu_mask_words long.
+void find_cpu_mask(int process, CpuMask* mask, bool* not_there) {
+  const size_t size = mask->size() * sizeof(unsigned long);
+  const int result = sched_getaffinity(
+      process, size, reinterpret_cast<cpu_set_t*>(mask->data()));
+  count_syscalls(1);
+
+  if (result == -1 && errno == ESRCH) {
+    *not_there = true;
+    return;
+  }
+  if (result != 0) {
+    PLOG(FATAL, "sched_getaffinity(%d, %zu, %p)", process, size,
+         mask->data());
+  }
+}
+
+sched_param find_sched_param(int process, bool* not_there) {
+  sched_param r;
+  const int result = sched_getparam(process, &r);
+  count_syscalls(1);
+
+  if (result == -1 && errno == ESRCH) {
+    *not_there = true;
+    return sched_param();
+  }
+  if (result != 0) {
+    PLOG(FATAL, "sched_getparam(%d)", process);
+  }
+
+  return r;
+}
+
+int find_scheduler(int process, bool* not_there) {
+  int scheduler = sched_getscheduler(process);
+  count_syscalls(1);
+
+  if (scheduler == -1 && errno == ESRCH) {
+    *not_there = true;
+    return 0;
+  }
+  if (scheduler == -1) {
+    PLOG(FATAL, "sched_getscheduler(%d)", process);
+  }
+
+  return scheduler;
+}
+
+// Gets the policy, nice value, priority, and everything else the kernel
+// schedules process with in one syscall.
+SchedAttr find_sched_attr(int process, bool* not_there) {
+  SchedAttr r;
+  const int result = sched_getattr(process, &r);
+  count_syscalls(1);
+
+  if (result == -1 && errno == ESRCH) {
+    *not_there = true;
+    return SchedAttr();
+  }
+  if (result != 0) {
+    PLOG(FATAL, "sched_getattr(%d)", process);
+  }
+
+  return r;
+}
+
+// Writes "<process>/<file>" into buffer for opening relative to /proc.
+void format_task_path(char (&buffer)[64], int process, std::string_view file) {
+  char* end = std::to_chars(buffer, buffer + 32, process).ptr;
+  *end++ = '/';
+  end = std::copy(file.begin(), file.end(), end);
+  *end = '\0';
+}
+
+// Reads up to size bytes of /proc/<process>/<file> into buffer with a single
+// read() and returns how many were read. Sets *not_there if the task is gone.
+size_t read_task_file(int proc_fd, int process, std::string_view file,
+                      char* buffer, size_t size, bool* not_there) {
+  char filename[64];
+  format_task_path(filename, process, file);
+  const int fd = openat(proc_fd, filename, O_RDONLY | O_CLOEXEC);
+
+  if (fd == -1 && (errno == ENOENT || errno == ESRCH)) {
+    *not_there = true;
+    return 0;
+  }
+  if (fd == -1) {
+    PLOG(FATAL, "openat(%d, %s)", proc_fd, filename);
+  }
+
+  const ssize_t result = read(fd, buffer, size);
+  count_syscalls(3, result > 0 ? result : 0);
+  if (result == -1) {
+    if (errno == ESRCH) {
+      PCHECK(close(fd));
+      *not_there = true;
+      return 0;
+    }
+    PLOG(FATAL, "read(%d, %p, %zu)", fd, buffer, size);
+  }
+  PCHECK(close(fd));
+
+  return result;
+}
+
+// Reads all of filename, relative to dir_fd, into buffer, growing it if needed,
+// and returns the contents. Sets *not_there if it doesn't exist or belongs to a
+// task that's gone.
+std::string_view read_file_at(int dir_fd, const char* filename,
+                              ScratchBuffer* buffer, bool* not_there) {
+  const int fd = openat(dir_fd, filename, O_RDONLY | O_CLOEXEC);
+
+  if (fd == -1 && (errno == ENOENT || errno == ESRCH)) {
+    *not_there = true;
+    return {};
+  }
+  if (fd == -1) {
+    PLOG(FATAL, "openat(%d, %s)", dir_fd, filename);
+  }
+  count_syscalls(2);
+
+  // Rereading from the start regenerates the whole file, so the contents
+  // always come from a single read() and are consistent.
+  ssize_t result;
+  do {
+    result = pread(fd, buffer->data(), buffer->size(), 0);
+    count_syscalls(1, result > 0 ? result : 0);
+    if (result == -1) {
+      if (errno == ESRCH) {
+        PCHECK(close(fd));
+        *not_there = true;
+        return {};
+      }
+      PLOG(FATAL, "pread(%d, %p, %zu)", fd, buffer->data(), buffer->size());
+    }
+  } while (buffer->grow_if_full(result));
+  PCHECK(close(fd));
+
+  return {buffer->data(), static_cast<size_t>(result)};
+}
+
+// Reads all of /proc/<process>/<file> into buffer like read_file_at().
+std::string_view read_task_file(int proc_fd, int process, std::string_view file,
+                                ScratchBuffer* buffer, bool* not_there) {
+  char filename[64];
+  format_task_path(filename, process, file);
+  return read_file_at(proc_fd, filename, buffer, not_there);
+}
+
+std::string_view find_exe(int proc_fd, int process, StringTable* strings,
+                          ScratchBuffer* buffer, bool* not_there) {
+  char exe_filename[64];
+  format_task_path(exe_filename, process, "exe");
+
+  // readlink() silently truncates, so a result that fills the buffer may be
+  // missing the end of the path.
+  ssize_t exe_size;
+  do {
+    exe_size =
+        readlinkat(proc_fd, exe_filename, buffer->data(), buffer->size());
+    count_syscalls(1, exe_size > 0 ? exe_size : 0);
+  } while (exe_size != -1 && buffer->grow_if_full(exe_size));
+
+  if (exe_size == -1) {
+    // Kernel threads have no exe, and tasks in other PID namespaces or that
+    // can't be ptrace()d can't have theirs read.
+    if (errno == ENOENT) {
+      return "ENOENT";
+    }
+    if (errno == EACCES) {
+      return "EACCES";
+    }
+    if (errno == ESRCH) {
+      *not_there = true;
+      return "";
+    }
+    PLOG(FATAL, "readlinkat(%d, %s, %p, %zu)", proc_fd, exe_filename,
+         buffer->data(), buffer->size());
+  }
+
+  return strings->intern({buffer->data(), static_cast<size_t>(exe_size)});
+}
+
+// Returns the process's command line with the arguments separated by spaces,
+// or an empty string for kernel threads.
+std::string_view read_cmdline(int proc_fd, int process, StringTable* strings,
+                              bool* not_there) {
+  // Long command lines are truncated since this is only for display.
+  char buffer[4096];
+  size_t size = read_task_file(proc_fd, process, "cmdline", buffer,
+                               sizeof(buffer), not_there);
+
+  while (size > 0 && buffer[size - 1] == '\0') {
+    --size;
+  }
+  std::replace(buffer, buffer + size, '\0', ' ');
+  return strings->intern({buffer, size});
+}
+
+// Returns the path of the process's cgroup in the hierarchy System::cpuset_fd
+// is the root of, or "" if there isn't one.
+std::string_view read_cgroup(int proc_fd, int process, const System& system,
+                             ScratchBuffer* scratch, StringTable* strings,
+                             bool* not_there) {
+  if (system.cpuset_fd == -1) {
+    return "";
+  }
+  std::string_view cgroups =
+      read_task_file(proc_fd, process, "cgroup", scratch, not_there);
+
+  // Each line is hierarchy-ID:controller-list:path, and the v2 hierarchy has
+  // ID 0 and no controllers.
+  while (!cgroups.empty()) {
+    const size_t newline = std::min(cgroups.find('\n'), cgroups.size());
+    const std::string_view line = cgroups.substr(0, newline);
+    cgroups.remove_prefix(std::min(newline + 1, cgroups.size()));
+
+    const size_t first_colon = line.find(':');
+    const size_t second_colon = line.find(':', first_colon + 1);
+    if (first_colon == std::string_view::npos ||
+        second_colon == std::string_view::npos) {
+      continue;
+    }
+    const std::string_view id = line.substr(0, first_colon);
+    const std::string_view controllers =
+        line.substr(first_colon + 1, second_colon - first_colon - 1);
+    bool matches = system.cpuset_v2 && id == "0";
+    for_each_list_item(controllers, [&](std::string_view controller) {
+      matches |= !system.cpuset_v2 && controller == "cpuset";
+    });
+    if (matches) {
+      return strings->intern(line.substr(second_colon + 1));
+    }
+  }
+  return "";
+}
+
+// Returns the CPUs that tasks in cgroup, a path from read_cgroup(), may run
+// on, or "" if that isn't known.
+std::string_view read_cpuset(const System& system, std::string_view cgroup,
+                             ScratchBuffer* scratch, StringTable* strings) {
+  if (cgroup.empty()) {
+    return "";
+  }
+  std::string filename{
+      cgroup.substr(std::min(cgroup.find_first_not_of('/'), cgroup.size()))};
+  filename += filename.empty() ? "" : "/";
+  filename += system.cpuset_v2 ? "cpuset.cpus.effective"
+                               : "cpuset.effective_cpus";
+
+  // Cgroups without the controller enabled don't have the file, and the cgroup
+  // can be removed once the process leaves it.
+  bool not_there = false;
+  const std::string_view cpus =
+      read_file_at(system.cpuset_fd, filename.c_str(), scratch, &not_there);
+  return not_there ? "" : strings->intern(strip(cpus));
+}
+
+int find_nice_value(int process, bool* not_there) {
+  errno = 0;
+  int nice_value = getpriority(PRIO_PROCESS, process);
+  count_syscalls(1);
+
+  if (errno == ESRCH) {
+    *not_there = true;
+    return 0;
+  }
+  if (errno != 0) {
+    PLOG(FATAL, "getpriority(PRIO_PROCESS, %d)", process);
+  }
+
+  return nice_value;
+}
+
+// The fields of /proc/<pid>/stat up through cguest_time, in file order. See
+// proc(5) for what each one means.
+struct Stat {
+  int pid = 0;
+  char comm[64] = {};
+  char state = '\0';
+  int ppid = 0;
+  int pgrp = 0;
+  int session = 0;
+  int tty_nr = 0;
+  int tpgid = 0;
+  uint32_t flags = 0;
+  uint64_t minflt = 0;
+  uint64_t cminflt = 0;
+  uint64_t majflt = 0;
+  uint64_t cmajflt = 0;
+  uint64_t utime = 0;
+  uint64_t stime = 0;
+  int64_t cutime = 0;
+  int64_t cstime = 0;
+  int64_t priority = 0;
+  int64_t nice = 0;
+  int64_t num_threads = 0;
+  int64_t itrealvalue = 0;
+  uint64_t starttime = 0;
+  uint64_t vsize = 0;
+  int64_t rss = 0;
+  uint64_t rsslim = 0;
+  uint64_t startcode = 0;
+  uint64_t endcode = 0;
+  uint64_t startstack = 0;
+  uint64_t kstkesp = 0;
+  uint64_t kstkeip = 0;
+  uint64_t signal = 0;
+  uint64_t blocked = 0;
+  uint64_t sigignore = 0;
+  uint64_t sigcatch = 0;
+  uint64_t wchan = 0;
+  uint64_t nswap = 0;
+  uint64_t cnswap = 0;
+  int exit_signal = 0;
+  int processor = 0;
+  uint32_t rt_priority = 0;
+  uint32_t policy = 0;
+  uint64_t delayacct_blkio_ticks = 0;
+  uint64_t guest_time = 0;
+  int64_t cguest_time = 0;
+};
+
+// Parses the integer at *pos into *value and advances *pos past it and the
+// separator following it. Returns false if there isn't an integer there.
+template <typename T>
+bool parse_stat_field(const char** pos, const char* end, T* value) {
+  const auto [ptr, ec] = std::from_chars(*pos, end, *value);
+  if (ec != std::errc{}) {
+    return false;
+  }
+  *pos = ptr < end ? ptr + 1 : ptr;
+  return true;
+}
+
+template <typename T, typename... Ts>
+bool parse_stat_fields(const char** pos, const char* end, T* value,
+                       Ts*... values) {
+  if (!parse_stat_field(pos, end, value)) {
+    return false;
+  }
+  if constexpr (sizeof...(values) > 0) {
+    return parse_stat_fields(pos, end, values...);
+  } else {
+    return true;
+  }
+}
+
+void read_stat(int proc_fd, int process, ScratchBuffer* scratch, Stat* stat,
+               bool* not_there) {
+  const std::string_view line =
+      read_task_file(proc_fd, process, "stat", scratch, not_there);
+  if (*not_there) {
+    return;
+  }
+
+  // comm is the only field that can contain spaces or parentheses, so it's
+  // delimited by the first '(' and the last ')'.
+  const char* const buffer = line.data();
+  const char* const end = buffer + line.size();
+  const char* pos = buffer;
+  const size_t comm_start = line.find('(');
+  const size_t comm_end = line.rfind(')');
+  if (comm_start == std::string_view::npos ||
+      comm_end == std::string_view::npos || comm_end < comm_start ||
+      comm_end + 4 >= line.size()) {
+    LOG(FATAL, "couldn't get fields from /proc/%d/stat", process);
+  }
+
+  if (!parse_stat_field(&pos, end, &stat->pid)) {
+    LOG(FATAL, "couldn't get fields from /proc/%d/stat", process);
+  }
+  const size_t comm_size =
+      std::min(comm_end - comm_start - 1, sizeof(stat->comm) - 1);
+  std::copy_n(buffer + comm_start + 1, comm_size, stat->comm);
+  stat->comm[comm_size] = '\0';
+  stat->state = buffer[comm_end + 2];
+
+  pos = buffer + comm_end + 4;
+  if (!parse_stat_fields(
+          &pos, end, &stat->ppid, &stat->pgrp, &stat->session, &stat->tty_nr,
+          &stat->tpgid, &stat->flags, &stat->minflt, &stat->cminflt,
+          &stat->majflt, &stat->cmajflt, &stat->utime, &stat->stime,
+          &stat->cutime, &stat->cstime, &stat->priority, &stat->nice,
+          &stat->num_threads, &stat->itrealvalue, &stat->starttime,
+          &stat->vsize, &stat->rss, &stat->rsslim, &stat->startcode,
+          &stat->endcode, &stat->startstack, &stat->kstkesp, &stat->kstkeip,
+          &stat->signal, &stat->blocked, &stat->sigignore, &stat->sigcatch,
+          &stat->wchan, &stat->nswap, &stat->cnswap, &stat->exit_signal,
+          &stat->processor, &stat->rt_priority, &stat->policy,
+          &stat->delayacct_blkio_ticks, &stat->guest_time,
+          &stat->cguest_time)) {
+    LOG(FATAL, "couldn't get fields from /proc/%d/stat", process);
+  }
+  CHECK_EQ(stat->pid, process);
+}
+
+// PF_KTHREAD from the kernel's include/linux/sched.h, which isn't exported to
+// userspace.
+constexpr uint32_t kKernelThreadFlag = 0x00200000;
+
+// Returns true if stat is a kernel thread's, by PF_KTHREAD, which every kernel
+// since 2.6.27 sets. Being a child of PID 2 isn't enough, since in a PID
+// namespace that's an ordinary process.
+bool is_kernel_thread(const Stat& stat) {
+  return (stat.flags & kKernelThreadFlag) != 0;
+}
+
+// Returns the IRQ a kernel thread named like irq/35-can0 handles, or -1 if the
+// name isn't an IRQ thread's.
+int parse_irq_thread_name(std::string_view name) {
+  constexpr std::string_view kPrefix = "irq/";
+  if (!name.starts_with(kPrefix)) {
+    return -1;
+  }
+  name.remove_prefix(kPrefix.size());
+  int irq;
+  const auto [end, ec] =
+      std::from_chars(name.data(), name.data() + name.size(), irq);
+  if (ec != std::errc{} || end == name.data() + name.size() || *end != '-') {
+    return -1;
+  }
+  return irq;
+}
+
+// Returns the CPUs irq is routed to, or "" if that isn't known.
+std::string_view read_irq_cpus(int proc_fd, int irq, ScratchBuffer* scratch,
+                               StringTable* strings) {
+  constexpr std::string_view kPrefix = "irq/";
+  constexpr std::string_view kFile = "/smp_affinity_list";
+  char filename[64];
+  char* end = std::copy(kPrefix.begin(), kPrefix.end(), filename);
+  end = std::to_chars(end, end + 16, irq).ptr;
+  end = std::copy(kFile.begin(), kFile.end(), end);
+  *end = '\0';
+
+  // The IRQ can be freed while its thread is still exiting.
+  bool not_there = false;
+  const std::string_view cpus =
+      read_file_at(proc_fd, filename, scratch, &not_there);
+  return not_there ? "" : strings->intern(strip(cpus));
+}
+
+// Returns the value of the "<key>:\t<value>" line for key in a
+// /proc/<pid>/status file, or an empty string if there isn't one.
+std::string_view find_status_value(std::string_view status,
+                                   std::string_view key) {
+  size_t pos = 0;
+  while (pos < status.size()) {
+    const size_t end = std::min(status.find('\n', pos), status.size());
+    std::string_view line = status.substr(pos, end - pos);
+    if (line.starts_with(key) && line.size() > key.size() &&
+        line[key.size()] == ':') {
+      line.remove_prefix(key.size() + 1);
+      return strip(line);
+    }
+    pos = end + 1;
+  }
+  return {};
+}
+
+// Reads Tgid from /proc/<pid>/status, warning if Pid and PPid don't match what
+// was read from stat.
+void read_status(int proc_fd, int process, int ppid, int* tgid,
+                 bool* not_there) {
+  // The fields used here are all near the start, so a long status file being
+  // truncated doesn't matter.
+  char buffer[4096];
+  const size_t size = read_task_file(proc_fd, process, "status", buffer,
+                                     sizeof(buffer), not_there);
+  if (*not_there) {
+    return;
+  }
+
+  const std::string_view status{buffer, size};
+  int pid = 0;
+  int status_ppid = 0;
+  for (auto [key, value] : {std::pair{"Pid", &pid},
+                            std::pair{"PPid", &status_ppid},
+                            std::pair{"Tgid", tgid}}) {
+    const std::string_view str = find_status_value(status, key);
+    if (std::from_chars(str.begin(), str.end(), *value).ec != std::errc{}) {
+      LOG(FATAL, "couldn't get %s from /proc/%d/status", key, process);
+    }
+  }
+
+  if (pid != process) {
+    LOG(WARNING, "/proc/%d/status has Pid %d", process, pid);
+  }
+  // This can legitimately differ if the task was reparented between reading
+  // stat and status.
+  if (status_ppid != ppid) {
+    LOG(WARNING, "/proc/%d/status has PPid %d but stat has %d", process,
+        status_ppid, ppid);
+  }
+}
+
+// Returns process's TGID from /proc/<pid>/status, or -1 if it's gone.
+int read_tgid(int proc_fd, int process) {
+  char buffer[4096];
+  bool not_there = false;
+  const size_t size = read_task_file(proc_fd, process, "status", buffer,
+                                     sizeof(buffer), &not_there);
+  if (not_there) {
+    return -1;
+  }
+
+  const std::string_view str =
+      find_status_value(std::string_view{buffer, size}, "Tgid");
+  int tgid;
+  if (std::from_chars(str.begin(), str.end(), tgid).ec != std::errc{}) {
+    LOG(FATAL, "couldn't get Tgid from /proc/%d/status", process);
+  }
+  return tgid;
+}
+
+// Reads the voluntary and involuntary context switch counts from
+// /proc/<pid>/status.
+void read_ctxt_switches(int proc_fd, int process, ScratchBuffer* scratch,
+                        uint64_t* voluntary, uint64_t* nonvoluntary,
+                        bool* not_there) {
+  // These are the last fields, after the Cpus_allowed and Mems_allowed masks
+  // which get long on big systems, so all of the file is read.
+  const std::string_view status =
+      read_task_file(proc_fd, process, "status", scratch, not_there);
+  if (*not_there) {
+    return;
+  }
+
+  for (auto [key, value] :
+       {std::pair{"voluntary_ctxt_switches", voluntary},
+        std::pair{"nonvoluntary_ctxt_switches", nonvoluntary}}) {
+    const std::string_view str = find_status_value(status, key);
+    std::from_chars(str.begin(), str.end(), *value);
+  }
+}
+
+// Reads the run time, run queue wait time, and timeslice count from
+// /proc/<pid>/schedstat, which is a single line of the three.
+void read_schedstat(int proc_fd, int process, TaskRecord* task,
+                    bool* not_there) {
+  char buffer[80];
+  const size_t size = read_task_file(proc_fd, process, "schedstat", buffer,
+                                     sizeof(buffer), not_there);
+  if (*not_there) {
+    return;
+  }
+
+  const char* pos = buffer;
+  const char* const end = buffer + size;
+  for (uint64_t* value : {&task->run_time, &task->wait_time,
+                          &task->timeslices}) {
+    const auto [ptr, ec] = std::from_chars(pos, end, *value);
+    if (ec != std::errc{}) {
+      LOG(FATAL, "couldn't parse /proc/%d/schedstat", process);
+    }
+    pos = ptr < end ? ptr + 1 : ptr;
+  }
+}
+
+// Fills in the parts of task that are the same for every thread in its
+// process, reading them only for the first thread seen.
+//
+// Kernel threads have no exe or command line, so they aren't read for them,
+// which saves a syscall for each of the often hundreds of them.
+void collect_process(const CollectOptions& options, const System& system,
+                     bool kernel_thread, Collector* collector, TaskRecord* task,
+                     bool* not_there) {
+  Collector::ProcessInfo& process = collector->processes[task->pid];
+  if (!process.valid) {
+    PhaseTimer timer{kExe};
+    if (kernel_thread) {
+      // What reading the exe link would have failed with.
+      process.exe = "ENOENT";
+      process.cmdline = "";
+    } else {
+      if (options.needs(kExeSource)) {
+        process.exe = find_exe(system.proc_fd, task->pid, &collector->strings,
+                               &collector->scratch, not_there);
+      }
+      if (options.needs_cmdline() && !*not_there) {
+        process.cmdline = read_cmdline(system.proc_fd, task->pid,
+                                       &collector->strings, not_there);
+      }
+    }
+    if (options.needs_cgroup() && !*not_there) {
+      process.cgroup =
+          read_cgroup(system.proc_fd, task->pid, system, &collector->scratch,
+                      &collector->strings, not_there);
+
+      // Most processes share a handful of cgroups, so each one's cpuset is
+      // only read once.
+      const auto [it, inserted] =
+          collector->cpusets.try_emplace(process.cgroup);
+      if (inserted) {
+        it->second = read_cpuset(system, process.cgroup, &collector->scratch,
+                                 &collector->strings);
+      }
+      process.cpuset = it->second;
+    }
+    process.valid = !*not_there;
+  }
+
+  task->exe = process.exe;
+  task->cmdline = process.cmdline;
+  task->cgroup = process.cgroup;
+  task->cpuset = process.cpuset;
+}
+
+// Sets *tids to every live task on the system in ascending TID order by
+// listing /proc and then each /proc/<pid>/task, which also gives each one's
+// process.
+//
+// If only_pids isn't empty, only those processes' tasks are listed, once each
+// however many times they're in it.
+void find_tids(int proc_fd, const std::vector<int>& only_pids,
+               std::vector<TaskId>* tids) {
+  // The PIDs are listed into the front of *tids and removed once their tasks
+  // have been appended, so nothing is allocated once it's big enough.
+  tids->clear();
+  if (only_pids.empty()) {
+    // proc_fd is reused across scans, so rewind it first.
+    if (lseek(proc_fd, 0, SEEK_SET) == -1) {
+      PLOG(FATAL, "lseek(%d, 0, SEEK_SET)", proc_fd);
+    }
+    for_each_pid_entry(proc_fd,
+                       [&](int pid) { tids->push_back({pid, pid}); });
+  } else {
+    // The list names processes, so TIDs that aren't a thread group leader are
+    // skipped like matches_pid() would, rather than listing their whole group
+    // under the wrong PID.
+    for (int pid : only_pids) {
+      if (read_tgid(proc_fd, pid) == pid) {
+        tids->push_back({pid, pid});
+      }
+    }
+    std::sort(tids->begin(), tids->end(),
+              [](TaskId a, TaskId b) { return a.tgid < b.tgid; });
+    tids->erase(
+        std::unique(tids->begin(), tids->end(),
+                    [](TaskId a, TaskId b) { return a.tgid == b.tgid; }),
+        tids->end());
+  }
+
+  const size_t pid_count = tids->size();
+  for (size_t i = 0; i < pid_count; ++i) {
+    const int pid = (*tids)[i].tgid;
+    char task_filename[32];
+    std::snprintf(task_filename, sizeof(task_filename), "%d/task", pid);
+    const int task_fd =
+        openat(proc_fd, task_filename, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    count_syscalls(1);
+    if (task_fd == -1) {
+      if (errno == ENOENT || errno == ESRCH) {
+        // The process exited after /proc was listed.
+        continue;
+      }
+      PLOG(FATAL, "openat(%d, %s)", proc_fd, task_filename);
+    }
+
+    for_each_pid_entry(task_fd,
+                       [&](int tid) { tids->push_back({tid, pid}); });
+    PCHECK(close(task_fd));
+    count_syscalls(1);
+  }
+  tids->erase(tids->begin(), tids->begin() + pid_count);
+
+  std::sort(tids->begin(), tids->end(),
+            [](TaskId a, TaskId b) { return a.tid < b.tid; });
+}
+
+}  // namespace
+
+bool collect_task(const CollectOptions& options, const System& system,
+                  TaskId id, Collector* collector, TaskRecord* task) {
+  const int process = id.tid;
+  bool not_there = false;
+
+  if (id.tgid != -1 && !options.matches_pid(id.tgid)) {
+    return false;
+  }
+
+  // Tasks only come from listing /proc unless stat is needed, so without it
+  // they're assumed to exist.
+  Stat stat;
+  if (options.needs(kStatSource)) {
+    PhaseTimer timer{kStat};
+    read_stat(system.proc_fd, process, &collector->scratch, &stat, &not_there);
+  }
+  if (not_there) {
+    // With --scan-pid-max most PIDs don't exist, which isn't worth counting.
+    collector->vanished += id.tgid != -1;
+    return false;
+  }
+  if (options.skip_zombies && (stat.state == 'Z' || stat.state == 'X')) {
+    return false;
+  }
+
+  // The policy, priority, and nice value all come from the stat read above by
+  // default so they're consistent with each other and the rest of the row.
+  task->policy = stat.policy;
+  task->priority = stat.rt_priority;
+  task->nice = stat.nice;
+  if (system.has_sched_getattr &&
+      (options.needs(kSchedSource) || options.needs_sched_attr())) {
+    PhaseTimer timer{kSched};
+    const SchedAttr attr = find_sched_attr(process, &not_there);
+    if (options.use_syscalls) {
+      task->policy = attr.sched_policy;
+      task->priority = attr.sched_priority;
+      task->nice = attr.sched_nice;
+    }
+    task->sched_flags = attr.sched_flags;
+    task->runtime = attr.sched_runtime;
+    task->deadline = attr.sched_deadline;
+    task->period = attr.sched_period;
+    task->util_min = attr.sched_util_min;
+    task->util_max = attr.sched_util_max;
+  } else if (options.needs(kSchedSource)) {
+    PhaseTimer timer{kSched};
+    task->priority = find_sched_param(process, &not_there).sched_priority;
+    if (!not_there) {
+      task->policy = find_scheduler(process, &not_there);
+    }
+    if (!not_there) {
+      task->nice = find_nice_value(process, &not_there);
+    }
+  }
+  if (not_there) {
+    ++collector->vanished;
+    return false;
+  }
+  if (!options.matches_sched(task->policy, task->priority) ||
+      !options.matches_name(stat.comm)) {
+    return false;
+  }
+
+  if (options.needs(kAffinitySource)) {
+    PhaseTimer timer{kSched};
+    task->cpu_mask.resize(system.cpu_mask_words);
+    find_cpu_mask(process, &task->cpu_mask, &not_there);
+  }
+  if (not_there) {
+    ++collector->vanished;
+    return false;
+  }
+  if (!options.matches_cpu_mask(task->cpu_mask)) {
+    return false;
+  }
+
+  // The process comes from listing /proc when possible, so status only needs
+  // to be read with --scan-pid-max or to cross-check with --paranoid.
+  task->pid = id.tgid;
+  if (id.tgid == -1 || options.paranoid) {
+    PhaseTimer timer{kStat};
+    read_status(system.proc_fd, process, stat.ppid, &task->pid, &not_there);
+    if (not_there) {
+      ++collector->vanished;
+      return false;
+    }
+    if (id.tgid != -1 && task->pid != id.tgid) {
+      // A non-leader thread exec()ed, which changes its TID to the TGID.
+      LOG(WARNING, "/proc/%d/status has Tgid %d but it was listed under %d",
+          process, task->pid, id.tgid);
+    }
+    if (!options.matches_pid(task->pid)) {
+      return false;
+    }
+  }
+
+  // Without stat, nothing is known to be a kernel thread, so it's all read.
+  const bool kernel_thread = is_kernel_thread(stat);
+  collect_process(options, system, kernel_thread, collector, task, &not_there);
+  if (not_there) {
+    ++collector->vanished;
+    return false;
+  }
+
+  if (options.needs_ctxt_switches()) {
+    PhaseTimer timer{kStat};
+    read_ctxt_switches(system.proc_fd, process, &collector->scratch,
+                       &task->voluntary_ctxt_switches,
+                       &task->nonvoluntary_ctxt_switches, &not_there);
+    if (not_there) {
+      ++collector->vanished;
+      return false;
+    }
+  }
+
+  if (options.needs_schedstat()) {
+    PhaseTimer timer{kStat};
+    read_schedstat(system.proc_fd, process, task, &not_there);
+    if (not_there) {
+      ++collector->vanished;
+      return false;
+    }
+  }
+
+  task->irq = kernel_thread ? parse_irq_thread_name(stat.comm) : -1;
+  task->irq_cpus = "";
+  if (task->irq != -1 && options.needs_irq()) {
+    PhaseTimer timer{kSched};
+    task->irq_cpus = read_irq_cpus(system.proc_fd, task->irq,
+                                   &collector->scratch, &collector->strings);
+  }
+
+  task->name = collector->strings.intern(stat.comm);
+  task->tid = process;
+  task->ppid = stat.ppid;
+  task->sid = stat.session;
+  task->cpu = stat.processor;
+  task->starttime = stat.starttime;
+  task->utime = stat.utime;
+  task->stime = stat.stime;
+
+  return true;
+}
+
+void yield_after(const CollectOptions& options, size_t collected) {
+  if (options.yield_every > 0 && collected % options.yield_every == 0) {
+    sched_yield();
+    count_syscalls(1);
+  }
+}
+
+void find_tids(const CollectOptions& options, const System& system,
+               std::vector<TaskId>* tids) {
+  if (!options.scan_pid_max) {
+    find_tids(system.proc_fd, options.pids, tids);
+    return;
+  }
+
+  tids->resize(system.pid_max);
+  for (int i = 0; i < system.pid_max; ++i) {
+    (*tids)[i] = {i, -1};
+  }
+}
+
+TaskSnapshot::TaskSnapshot(const CollectOptions& options)
+    : options_{options}, system_{find_system()} {
+  options_.resolve_sources();
+  // Without CONFIG_SCHED_INFO every task's schedstat is missing, which would
+  // make every task look like it vanished, so the columns are left at 0 the
+  // way the sched_getattr() ones are without that syscall.
+  if (!system_.has_schedstat) {
+    options_.sources &= ~uint32_t{kSchedstatSource};
+  }
+}
+
+TaskSnapshot::~TaskSnapshot() {
+  PCHECK(close(system_.proc_fd));
+  if (system_.cpuset_fd != -1) {
+    PCHECK(close(system_.cpuset_fd));
+  }
+}
+
+}  // namespace dump_rtprio
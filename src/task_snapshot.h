@@ -0,0 +1,812 @@
+// Copyright (c) Tyler Veness.
+
+#pragma once
+
+#include <regex.h>
+#include <stdint.h>
+#include <time.h>
+
+#include <algorithm>
+#include <memory>
+#include <span>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "logging.h"
+
+// The task collection dump_rtprio is built on. TaskSnapshot at the bottom is
+// the entry point for other programs; the rest is what it and dump_rtprio
+// share. Errors dump_rtprio can't recover from, like /proc being unreadable,
+// print a message and exit the process.
+
+namespace dump_rtprio {
+
+// The parts of a scan that are timed separately with CollectOptions::stats.
+enum Phase { kDiscovery, kStat, kSched, kExe, kFormat, kNumPhases };
+
+inline constexpr const char* kPhaseNames[kNumPhases] = {
+    "discovery", "stat", "sched", "exe", "format"};
+
+// Counters for CollectOptions::stats.
+struct ScanStats {
+  uint64_t tasks = 0;
+  uint64_t syscalls = 0;
+  uint64_t bytes_read = 0;
+  uint64_t phase_ns[kNumPhases] = {};
+
+  void add(const ScanStats& other) {
+    tasks += other.tasks;
+    syscalls += other.syscalls;
+    bytes_read += other.bytes_read;
+    for (int i = 0; i < kNumPhases; ++i) {
+      phase_ns[i] += other.phase_ns[i];
+    }
+  }
+};
+
+// Where the current thread's counters go, or nullptr if it isn't being
+// benchmarked. A thread_local keeps the counting out of every signature.
+extern thread_local ScanStats* current_stats;
+
+inline void count_syscalls(uint64_t syscalls, uint64_t bytes_read = 0) {
+  if (current_stats != nullptr) {
+    current_stats->syscalls += syscalls;
+    current_stats->bytes_read += bytes_read;
+  }
+}
+
+inline uint64_t monotonic_ns() {
+  timespec now;
+  PCHECK(clock_gettime(CLOCK_MONOTONIC, &now));
+  return now.tv_sec * uint64_t{1'000'000'000} + now.tv_nsec;
+}
+
+// Adds the time between its construction and destruction to a phase of
+// current_stats, if there is one.
+class PhaseTimer {
+ public:
+  explicit PhaseTimer(Phase phase)
+      : phase_{phase},
+        start_{current_stats != nullptr ? monotonic_ns() : 0} {}
+
+  PhaseTimer(const PhaseTimer&) = delete;
+  PhaseTimer& operator=(const PhaseTimer&) = delete;
+
+  ~PhaseTimer() {
+    if (current_stats != nullptr) {
+      current_stats->phase_ns[phase_] += monotonic_ns() - start_;
+    }
+  }
+
+ private:
+  Phase phase_;
+  uint64_t start_;
+};
+
+// Stores each distinct string once, in large blocks that are reused after
+// clear(), so interning doesn't allocate once the table has warmed up. The
+// returned string_views are valid until clear().
+class StringTable {
+ public:
+  StringTable() : slots_(64) {}
+
+  StringTable(const StringTable&) = delete;
+  StringTable& operator=(const StringTable&) = delete;
+  StringTable(StringTable&&) = default;
+  StringTable& operator=(StringTable&&) = default;
+
+  // Returns the table's copy of str, adding it first if it isn't there.
+  std::string_view intern(std::string_view str) {
+    std::string_view* slot = find_slot(str);
+    if (slot->data() == nullptr) {
+      *slot = store(str);
+      if (++size_ * 2 > slots_.size()) {
+        grow();
+      }
+      return *find_slot(str);
+    }
+    return *slot;
+  }
+
+  void clear() {
+    std::fill(slots_.begin(), slots_.end(), std::string_view{});
+    size_ = 0;
+    block_ = 0;
+    block_used_ = 0;
+  }
+
+ private:
+  static constexpr size_t kBlockSize = 65536;
+
+  struct Block {
+    std::unique_ptr<char[]> data;
+    size_t size;
+  };
+
+  // Open-addressed with linear probing. Empty slots have a null data().
+  std::vector<std::string_view> slots_;
+  size_t size_ = 0;
+
+  std::vector<Block> blocks_;
+  size_t block_ = 0;
+  size_t block_used_ = 0;
+
+  std::string_view* find_slot(std::string_view str) {
+    const size_t mask = slots_.size() - 1;
+    for (size_t i = std::hash<std::string_view>{}(str) & mask;;
+         i = (i + 1) & mask) {
+      if (slots_[i].data() == nullptr || slots_[i] == str) {
+        return &slots_[i];
+      }
+    }
+  }
+
+  void grow() {
+    std::vector<std::string_view> old(slots_.size() * 2);
+    old.swap(slots_);
+    for (std::string_view str : old) {
+      if (str.data() != nullptr) {
+        *find_slot(str) = str;
+      }
+    }
+  }
+
+  std::string_view store(std::string_view str) {
+    while (block_ < blocks_.size() &&
+           blocks_[block_].size - block_used_ < str.size() + 1) {
+      ++block_;
+      block_used_ = 0;
+    }
+    if (block_ == blocks_.size()) {
+      const size_t size = std::max(kBlockSize, str.size() + 1);
+      blocks_.push_back({std::make_unique<char[]>(size), size});
+    }
+
+    // NUL-terminate so the data() of every interned string can be passed to C
+    // APIs.
+    char* data = blocks_[block_].data.get() + block_used_;
+    std::copy(str.begin(), str.end(), data);
+    data[str.size()] = '\0';
+    block_used_ += str.size() + 1;
+    return {data, str.size()};
+  }
+};
+
+// A map from TIDs (or PIDs) to V, open-addressed so that lookups and, once
+// it's warmed up, insertions and clear() don't allocate.
+template <typename V>
+class TidMap {
+ public:
+  TidMap() : slots_(64) {}
+
+  // Returns the value for tid, or nullptr if there isn't one.
+  V* find(int tid) {
+    Slot& slot = find_slot(tid);
+    return slot.tid == tid ? &slot.value : nullptr;
+  }
+
+  // Returns the value for tid, default-constructing it first if it isn't
+  // there.
+  V& operator[](int tid) {
+    Slot* slot = &find_slot(tid);
+    if (slot->tid == kEmpty) {
+      if ((size_ + 1) * 2 > slots_.size()) {
+        grow();
+        slot = &find_slot(tid);
+      }
+      slot->tid = tid;
+      slot->value = V{};
+      ++size_;
+    }
+    return slot->value;
+  }
+
+  // Removes the value for tid, if there is one.
+  void erase(int tid) {
+    Slot* slot = &find_slot(tid);
+    if (slot->tid != tid) {
+      return;
+    }
+
+    // Shift later entries in the probe sequence back into the hole when that
+    // doesn't move them before their home slot, so lookups don't stop at it.
+    const size_t mask = slots_.size() - 1;
+    size_t hole = slot - slots_.data();
+    for (size_t i = (hole + 1) & mask; slots_[i].tid != kEmpty;
+         i = (i + 1) & mask) {
+      if (((i - home(slots_[i].tid)) & mask) >= ((i - hole) & mask)) {
+        slots_[hole] = std::move(slots_[i]);
+        hole = i;
+      }
+    }
+    slots_[hole].tid = kEmpty;
+    --size_;
+  }
+
+  void clear() {
+    for (Slot& slot : slots_) {
+      slot.tid = kEmpty;
+    }
+    size_ = 0;
+  }
+
+  // Calls func(tid, value) for each entry, in no particular order.
+  template <typename F>
+  void for_each(F&& func) {
+    for (Slot& slot : slots_) {
+      if (slot.tid != kEmpty) {
+        func(slot.tid, slot.value);
+      }
+    }
+  }
+
+ private:
+  static constexpr int kEmpty = -1;
+
+  struct Slot {
+    int tid = kEmpty;
+    V value{};
+  };
+
+  std::vector<Slot> slots_;
+  size_t size_ = 0;
+
+  // Returns where tid's probe sequence starts.
+  size_t home(int tid) const {
+    // TIDs are mostly sequential, so mix them up a bit before probing.
+    return (static_cast<uint32_t>(tid) * 2654435761u) & (slots_.size() - 1);
+  }
+
+  Slot& find_slot(int tid) {
+    const size_t mask = slots_.size() - 1;
+    for (size_t i = home(tid);; i = (i + 1) & mask) {
+      if (slots_[i].tid == kEmpty || slots_[i].tid == tid) {
+        return slots_[i];
+      }
+    }
+  }
+
+  void grow() {
+    std::vector<Slot> old(slots_.size() * 2);
+    old.swap(slots_);
+    for (Slot& slot : old) {
+      if (slot.tid != kEmpty) {
+        find_slot(slot.tid) = std::move(slot);
+      }
+    }
+  }
+};
+
+// A task to collect.
+struct TaskId {
+  int tid = 0;
+
+  // The process the task belongs to, or -1 if that isn't known yet.
+  int tgid = -1;
+};
+
+// A CPU affinity mask in the layout sched_getaffinity() uses, sized for every
+// CPU the kernel supports rather than the 1024 a cpu_set_t holds.
+using CpuMask = std::vector<unsigned long>;
+
+inline constexpr int kBitsPerWord = 8 * sizeof(unsigned long);
+
+// Calls func with each comma-separated item in list.
+template <typename F>
+void for_each_list_item(std::string_view list, F&& func) {
+  while (!list.empty()) {
+    const size_t comma = std::min(list.find(','), list.size());
+    func(list.substr(0, comma));
+    list.remove_prefix(std::min(comma + 1, list.size()));
+  }
+}
+
+// Sets *mask, which must already be System::cpu_mask_words long, to the CPUs
+// in a list like "0-3,6". Returns false if it isn't one.
+bool parse_cpu_list(std::string_view list, CpuMask* mask);
+
+// Things about the system that are looked up once at startup.
+struct System {
+  // /proc, opened for use as the dirfd of per-task openat() calls.
+  int proc_fd = -1;
+
+  // Number of configured CPUs.
+  int nproc = 0;
+
+  // Number of words in a CpuMask that the kernel will accept.
+  size_t cpu_mask_words = 0;
+
+  int pid_max = 0;
+
+  // Seconds since the epoch the system booted at.
+  uint64_t boot_time = 0;
+
+  // The unit of the times in /proc/<pid>/stat.
+  long clock_ticks_per_second = 100;
+
+  // Whether the kernel has sched_getattr(), added in 3.14.
+  bool has_sched_getattr = false;
+
+  // Whether /proc/<pid>/schedstat exists, which needs CONFIG_SCHED_INFO.
+  bool has_schedstat = false;
+
+  // The CPUs taken away from the scheduler with isolcpus= or that run without
+  // a tick with nohz_full=.
+  CpuMask isolated_cpus;
+
+  // The root of the cgroup hierarchy the cpuset controller is in, opened for
+  // use as the dirfd of per-cgroup openat() calls, or -1 if there isn't one.
+  int cpuset_fd = -1;
+
+  // Whether that's the cgroup v2 hierarchy rather than a v1 cpuset one, which
+  // names its files differently.
+  bool cpuset_v2 = false;
+};
+
+// Looks up everything in System.
+System find_system();
+
+// A buffer for reading into that doubles whenever what's read doesn't fit. It's
+// kept with the rest of a Collector's state and reused for every task, so it
+// stops allocating once it's big enough for the longest file or path seen.
+class ScratchBuffer {
+ public:
+  ScratchBuffer() : buffer_(1024) {}
+
+  char* data() { return buffer_.data(); }
+  size_t size() const { return buffer_.size(); }
+
+  // Discards the contents and doubles the size.
+  void grow() {
+    const size_t size = buffer_.size() * 2;
+    buffer_.clear();
+    buffer_.resize(size);
+  }
+
+  // Returns true if size bytes read into the buffer may have been truncated,
+  // growing it first if so.
+  bool grow_if_full(size_t size) {
+    if (size < buffer_.size()) {
+      return false;
+    }
+    grow();
+    return true;
+  }
+
+ private:
+  std::vector<char> buffer_;
+};
+
+// What collect_task() can read for each task. Anything a run doesn't need
+// isn't read.
+enum Source : uint32_t {
+  // /proc/<pid>/stat.
+  kStatSource = 1 << 0,
+
+  // /proc/<pid>/status, for the context switch counts.
+  kStatusSource = 1 << 1,
+
+  // The /proc/<pid>/exe link.
+  kExeSource = 1 << 2,
+
+  // /proc/<pid>/cmdline.
+  kCmdlineSource = 1 << 3,
+
+  // sched_getattr() or, on kernels without it, sched_getscheduler(),
+  // sched_getparam(), and getpriority().
+  kSchedSource = 1 << 4,
+
+  // The parts of sched_getattr() that aren't in stat.
+  kSchedAttrSource = 1 << 5,
+
+  // sched_getaffinity().
+  kAffinitySource = 1 << 6,
+
+  // /proc/<pid>/cgroup and the cgroup's cpuset.
+  kCgroupSource = 1 << 7,
+
+  // /proc/irq/<irq>/smp_affinity_list for IRQ threads.
+  kIrqSource = 1 << 8,
+
+  // The policy, priority, and nice value, which come from stat or the
+  // kSchedSource syscalls depending on CollectOptions::use_syscalls.
+  kSchedStateSource = 1 << 9,
+
+  // /proc/<pid>/schedstat.
+  kSchedstatSource = 1 << 10,
+};
+
+// What to collect about each task and which tasks to collect it for.
+struct CollectOptions {
+  // Probe every PID up to pid_max instead of listing /proc.
+  bool scan_pid_max = false;
+
+  // Get the policy, priority, and nice value from sched_getattr() (or
+  // sched_getscheduler(), sched_getparam(), and getpriority() on kernels
+  // without it) instead of /proc/<pid>/stat.
+  bool use_syscalls = false;
+
+  // Read /proc/<pid>/status too and check that it agrees with stat and the
+  // listing of /proc.
+  bool paranoid = false;
+
+  // Number of threads to collect tasks with.
+  int jobs = 1;
+
+  // sched_yield() after collecting each batch of this many tasks, or never if
+  // it's 0.
+  int yield_every = 0;
+
+  // Count syscalls, bytes read, and the time spent in each Phase in each
+  // Collector's stats.
+  bool stats = false;
+
+  // Treat zombies, which stay in /proc until they're reaped, as already gone,
+  // the way the proc connector's exit events do.
+  bool skip_zombies = false;
+
+  // Only tasks matching all of the following are collected.
+
+  // Bit N is set if policy N is allowed. Each one fits since the SCHED_*
+  // constants are small.
+  uint32_t policies = ~uint32_t{0};
+
+  int min_priority = 0;
+
+  // The processes whose tasks are allowed, or empty to allow all of them.
+  std::vector<int> pids;
+
+  // Matched against each task's name, if has_name_regex is true.
+  bool has_name_regex = false;
+  regex_t name_regex;
+
+  // The CPU tasks' cpumasks must include, or -1 to allow any.
+  int cpu = -1;
+
+  // The Sources to read, which by default are the ones dump_rtprio's default
+  // columns need. resolve_sources() has to be called after changing it.
+  // TaskSnapshot drops kSchedstatSource when the kernel doesn't have it.
+  uint32_t sources =
+      kStatSource | kSchedStateSource | kAffinitySource | kExeSource;
+
+  // Adds the Sources the filters and options above need to sources, and
+  // resolves kSchedStateSource to the Source that provides it.
+  void resolve_sources() {
+    if (policies != ~uint32_t{0} || min_priority != 0) {
+      sources |= kSchedStateSource;
+    }
+    if (has_name_regex) {
+      sources |= kStatSource;
+    }
+    if (cpu != -1) {
+      sources |= kAffinitySource;
+    }
+
+    // stat is what shows a task exists with scan_pid_max, and paranoid checks
+    // it. It also has the state that shows a zombie.
+    if (scan_pid_max || paranoid || skip_zombies) {
+      sources |= kStatSource;
+    }
+
+    if (sources & kSchedStateSource) {
+      sources &= ~kSchedStateSource;
+      sources |= use_syscalls ? kSchedSource : kStatSource;
+    }
+  }
+
+  bool needs(Source source) const { return (sources & source) != 0; }
+
+  // Returns true if TaskRecord::cmdline is used.
+  bool needs_cmdline() const { return needs(kCmdlineSource); }
+
+  // Returns true if TaskRecord::cgroup and TaskRecord::cpuset are used.
+  bool needs_cgroup() const { return needs(kCgroupSource); }
+
+  // Returns true if TaskRecord's sched_getattr() fields are used.
+  bool needs_sched_attr() const { return needs(kSchedAttrSource); }
+
+  // Returns true if TaskRecord::irq_cpus is used.
+  bool needs_irq() const { return needs(kIrqSource); }
+
+  // Returns true if TaskRecord's context switch counts are used.
+  bool needs_ctxt_switches() const { return needs(kStatusSource); }
+
+  // Returns true if TaskRecord's schedstat fields are used.
+  bool needs_schedstat() const { return needs(kSchedstatSource); }
+
+  // The filters below are split up by what they need so each one can be
+  // checked as soon as possible.
+
+  bool matches_pid(int pid) const {
+    return pids.empty() ||
+           std::find(pids.begin(), pids.end(), pid) != pids.end();
+  }
+
+  bool matches_sched(int policy, int priority) const {
+    return policy >= 0 && policy < 32 && (policies & (uint32_t{1} << policy)) &&
+           priority >= min_priority;
+  }
+
+  bool matches_name(const char* name) const {
+    return !has_name_regex || regexec(&name_regex, name, 0, nullptr, 0) == 0;
+  }
+
+  bool matches_cpu_mask(const CpuMask& mask) const {
+    const size_t word = cpu / kBitsPerWord;
+    return cpu == -1 ||
+           (word < mask.size() && (mask[word] & (1ul << (cpu % kBitsPerWord))));
+  }
+};
+
+// Everything collected for one task.
+struct TaskRecord {
+  // These point into the Collector that filled in the task. cmdline is only
+  // filled in if CollectOptions::needs_cmdline() is true.
+  std::string_view exe;
+  std::string_view name;
+  std::string_view cmdline;
+
+  // The same for every thread in the process. Only filled in if
+  // CollectOptions::needs_cgroup() is true.
+  std::string_view cgroup;
+  std::string_view cpuset;
+
+  CpuMask cpu_mask;
+  int policy = 0;
+  int nice = 0;
+  int priority = 0;
+  int tid = 0;
+  int pid = 0;
+  int ppid = 0;
+  int sid = 0;
+
+  // The CPU the task last ran on.
+  int cpu = 0;
+
+  // The IRQ the task handles if it's an IRQ thread, like irq/35-can0, or -1.
+  // irq_cpus is the IRQ's smp_affinity_list, or "" if it isn't known, and is
+  // only filled in if CollectOptions::needs_irq() is true.
+  int irq = -1;
+  std::string_view irq_cpus;
+
+  // The rest of what sched_getattr() returns. Only filled in if
+  // CollectOptions::needs_sched_attr() is true.
+  uint64_t sched_flags = 0;
+  uint64_t runtime = 0;
+  uint64_t deadline = 0;
+  uint64_t period = 0;
+  uint32_t util_min = 0;
+  uint32_t util_max = 0;
+
+  // Clock ticks spent in user and kernel mode.
+  uint64_t utime = 0;
+  uint64_t stime = 0;
+
+  // Only filled in if CollectOptions::needs_ctxt_switches() is true.
+  uint64_t voluntary_ctxt_switches = 0;
+  uint64_t nonvoluntary_ctxt_switches = 0;
+
+  // Nanoseconds spent on a CPU and waiting on a run queue, and how many times
+  // the task was switched to. Only filled in if
+  // CollectOptions::needs_schedstat() is true.
+  uint64_t run_time = 0;
+  uint64_t wait_time = 0;
+  uint64_t timeslices = 0;
+
+  // Distinguishes tasks that reused the TID of one that exited.
+  uint64_t starttime = 0;
+};
+
+// State for collecting tasks that's reused from one to the next. Each thread
+// collecting tasks has its own.
+struct Collector {
+  // Holds the exe and name of every task collected since the last clear().
+  StringTable strings;
+
+  // What files and links are read into before they're parsed or interned.
+  ScratchBuffer scratch;
+
+  // What's been read about each process seen since the last clear(), so it's
+  // only read once for all of the process's threads.
+  struct ProcessInfo {
+    bool valid = false;
+    std::string_view exe;
+    std::string_view cmdline;
+    std::string_view cgroup;
+    std::string_view cpuset;
+  };
+  TidMap<ProcessInfo> processes;
+
+  // The cpuset of each cgroup seen since the last clear().
+  std::unordered_map<std::string_view, std::string_view> cpusets;
+
+  // What each task is collected into, so its cpumask is only allocated once.
+  TaskRecord task;
+
+  // Tasks that were listed but exited before they could be collected.
+  uint64_t vanished = 0;
+
+  // Only counted with CollectOptions::stats.
+  ScanStats stats;
+
+  void clear() {
+    strings.clear();
+    processes.clear();
+    cpusets.clear();
+    vanished = 0;
+    stats = ScanStats{};
+  }
+};
+
+// Fills in task for the given TID. Returns false if it doesn't exist (or
+// exited partway through) or doesn't match the filters in options, which are
+// checked as early as possible so rejected tasks cost as little as possible.
+// The strings in task are only valid until collector is cleared.
+bool collect_task(const CollectOptions& options, const System& system,
+                  TaskId id, Collector* collector, TaskRecord* task);
+
+// With options.yield_every, gives up the CPU after every batch of that many
+// tasks, counting from 1, so a long scan doesn't hold it for its whole length.
+void yield_after(const CollectOptions& options, size_t collected);
+
+// Collects the given TIDs and calls func with each one that exists, in the
+// same order as tids. With options.jobs > 1, each thread takes a contiguous
+// slice of tids and func is called once they're all done.
+//
+// collectors is cleared and resized to one per thread first. The strings in
+// the tasks passed to func stay valid until it's next used.
+template <typename F>
+void collect_tasks(const CollectOptions& options, const System& system,
+                   const std::vector<TaskId>& tids,
+                   std::vector<Collector>* collectors, F&& func) {
+  const size_t jobs = std::clamp<size_t>(tids.size(), 1, options.jobs);
+  collectors->resize(jobs);
+  for (Collector& collector : *collectors) {
+    collector.clear();
+  }
+
+  // Formatting happens on this thread, so it's counted with the first
+  // collector's stats.
+  ScanStats* const saved_stats = current_stats;
+  if (options.stats) {
+    current_stats = &(*collectors)[0].stats;
+    current_stats->tasks += tids.size();
+  }
+
+  if (jobs == 1) {
+    Collector& collector = (*collectors)[0];
+    TaskRecord& task = collector.task;
+    for (size_t i = 0; i < tids.size(); ++i) {
+      if (collect_task(options, system, tids[i], &collector, &task)) {
+        PhaseTimer timer{kFormat};
+        func(task);
+      }
+      yield_after(options, i + 1);
+    }
+    current_stats = saved_stats;
+    return;
+  }
+
+  std::vector<std::vector<TaskRecord>> results(jobs);
+  std::vector<std::thread> workers;
+  workers.reserve(jobs);
+
+  for (size_t job = 0; job < jobs; ++job) {
+    const size_t begin = tids.size() * job / jobs;
+    const size_t end = tids.size() * (job + 1) / jobs;
+    workers.emplace_back([&, begin, end, job] {
+      if (options.stats) {
+        current_stats = &(*collectors)[job].stats;
+      }
+
+      std::vector<TaskRecord>& tasks = results[job];
+      tasks.reserve(end - begin);
+
+      TaskRecord task;
+      for (size_t i = begin; i < end; ++i) {
+        if (collect_task(options, system, tids[i], &(*collectors)[job],
+                         &task)) {
+          tasks.push_back(std::move(task));
+        }
+        yield_after(options, i - begin + 1);
+      }
+    });
+  }
+
+  for (size_t job = 0; job < jobs; ++job) {
+    workers[job].join();
+    PhaseTimer timer{kFormat};
+    for (const TaskRecord& task : results[job]) {
+      func(task);
+    }
+  }
+  current_stats = saved_stats;
+}
+
+// Sets *tids to what collect_tasks() should collect: every task on the system
+// in ascending TID order, or with options.scan_pid_max, every possible TID.
+void find_tids(const CollectOptions& options, const System& system,
+               std::vector<TaskId>* tids);
+
+// Like the above, but returns a new vector.
+inline std::vector<TaskId> find_tids(const CollectOptions& options,
+                                     const System& system) {
+  std::vector<TaskId> tids;
+  find_tids(options, system, &tids);
+  return tids;
+}
+
+// Takes snapshots of the tasks on the system for programs that want them
+// in-process instead of running dump_rtprio:
+//
+//   dump_rtprio::CollectOptions options;
+//   options.sources = dump_rtprio::kStatSource | dump_rtprio::kAffinitySource;
+//   options.min_priority = 1;
+//   dump_rtprio::TaskSnapshot snapshot{options};
+//   while (true) {
+//     snapshot.take([](const dump_rtprio::TaskRecord& task) { ... });
+//     ...
+//   }
+//
+// Its buffers are kept from one snapshot to the next, so once they've grown to
+// fit, taking one doesn't allocate. The exceptions are options.jobs > 1,
+// which starts threads for each snapshot, and kCgroupSource.
+class TaskSnapshot {
+ public:
+  explicit TaskSnapshot(const CollectOptions& options);
+
+  TaskSnapshot(const TaskSnapshot&) = delete;
+  TaskSnapshot& operator=(const TaskSnapshot&) = delete;
+
+  ~TaskSnapshot();
+
+  const CollectOptions& options() const { return options_; }
+  const System& system() const { return system_; }
+
+  // Collects every task matching the options and calls visitor(const
+  // TaskRecord&) with each one in TID order. The records are only valid
+  // during the call, and their strings until the next snapshot.
+  template <typename F>
+  void take(F&& visitor) {
+    find_tids(options_, system_, &tids_);
+    collect_tasks(options_, system_, tids_, &collectors_, visitor);
+  }
+
+  // Like take(visitor), but returns the records, which are valid until the
+  // next snapshot.
+  std::span<const TaskRecord> take() {
+    size_t count = 0;
+    take([&](const TaskRecord& task) {
+      // Assigning over the previous snapshot's records reuses their cpumasks.
+      if (count == records_.size()) {
+        records_.push_back(task);
+      } else {
+        records_[count] = task;
+      }
+      ++count;
+    });
+    return {records_.data(), count};
+  }
+
+  // Returns how many tasks were listed but exited before they could be
+  // collected in the last snapshot.
+  uint64_t vanished() const {
+    uint64_t r = 0;
+    for (const Collector& collector : collectors_) {
+      r += collector.vanished;
+    }
+    return r;
+  }
+
+ private:
+  CollectOptions options_;
+  System system_;
+  std::vector<TaskId> tids_;
+  std::vector<Collector> collectors_;
+  std::vector<TaskRecord> records_;
+};
+
+}  // namespace dump_rtprio